@@ -0,0 +1,124 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ChangeDetector.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Cheap measure of how much an image differs from a
+//				  reference image.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "ChangeDetector.h"
+#include <emmintrin.h>
+#include <cstring>
+
+using namespace std;
+
+ChangeDetector::ChangeDetector() :
+	width_(0),
+	height_(0),
+	bytesPerPixel_(1),
+	rowStep_(1),
+	tilesX_(0),
+	tilesY_(0),
+	hasReference_(false)
+{
+}
+
+void ChangeDetector::Configure(unsigned width, unsigned height, unsigned bytesPerPixel, unsigned rowStep)
+{
+	width_ = width;
+	height_ = height;
+	bytesPerPixel_ = bytesPerPixel;
+	rowStep_ = rowStep > 0 ? rowStep : 1;
+	tilesX_ = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY_ = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+	unsigned rows = (height + rowStep_ - 1) / rowStep_;
+	reference_.resize((size_t)rows * width * bytesPerPixel);
+	tileSums_.resize((size_t)tilesX_ * tilesY_);
+	tilePixels_.resize((size_t)tilesX_ * tilesY_);
+	hasReference_ = false;
+}
+
+void ChangeDetector::SetReference(const unsigned char* image)
+{
+	const size_t rowBytes = (size_t)width_ * bytesPerPixel_;
+	unsigned char* dst = reference_.empty() ? 0 : &reference_[0];
+	for (unsigned y = 0; y < height_; y += rowStep_, dst += rowBytes)
+		memcpy(dst, image + y * rowBytes, rowBytes);
+	hasReference_ = true;
+}
+
+double ChangeDetector::Score(const unsigned char* image)
+{
+	if (!hasReference_ || tileSums_.empty())
+		return 0;
+
+	memset(&tileSums_[0], 0, tileSums_.size() * sizeof(tileSums_[0]));
+	memset(&tilePixels_[0], 0, tilePixels_.size() * sizeof(tilePixels_[0]));
+
+	const size_t rowBytes = (size_t)width_ * bytesPerPixel_;
+	const unsigned char* ref = &reference_[0];
+	for (unsigned y = 0; y < height_; y += rowStep_, ref += rowBytes) {
+		const unsigned char* row = image + y * rowBytes;
+		size_t tile = (size_t)(y / TILE_SIZE) * tilesX_;
+		for (unsigned x = 0; x < width_; x += TILE_SIZE, tile++) {
+			unsigned n = (width_ - x < TILE_SIZE) ? width_ - x : TILE_SIZE;
+			if (bytesPerPixel_ == 2) {
+				tileSums_[tile] += RowSad16(reinterpret_cast<const unsigned short*>(row) + x,
+					reinterpret_cast<const unsigned short*>(ref) + x, n);
+			}
+			else {
+				tileSums_[tile] += RowSad8(row + x, ref + x, n);
+			}
+			tilePixels_[tile] += n;
+		}
+	}
+
+	double score = 0;
+	for (size_t t = 0; t < tileSums_.size(); t++) {
+		if (tilePixels_[t] > 0 && (double)tileSums_[t] / tilePixels_[t] > score)
+			score = (double)tileSums_[t] / tilePixels_[t];
+	}
+	return score;
+}
+
+// psadbw sums the absolute differences of 8 byte pairs into each 64 bit
+// half of the register.
+unsigned ChangeDetector::RowSad8(const unsigned char* a, const unsigned char* b, unsigned n)
+{
+	__m128i acc = _mm_setzero_si128();
+	unsigned x = 0;
+	for (; x + 16 <= n; x += 16) {
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i*)(a + x)),
+			_mm_loadu_si128((const __m128i*)(b + x))));
+	}
+
+	// A row of one tile is far too short to overflow 32 bits.
+	unsigned sum = (unsigned)_mm_cvtsi128_si32(acc) + (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+	for (; x < n; x++)
+		sum += (a[x] > b[x]) ? a[x] - b[x] : b[x] - a[x];
+	return sum;
+}
+
+unsigned ChangeDetector::RowSad16(const unsigned short* a, const unsigned short* b, unsigned n)
+{
+	unsigned sum = 0;
+	for (unsigned x = 0; x < n; x++)
+		sum += (a[x] > b[x]) ? a[x] - b[x] : b[x] - a[x];
+	return sum;
+}
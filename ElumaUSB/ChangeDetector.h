@@ -0,0 +1,66 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ChangeDetector.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Cheap measure of how much an image differs from a
+//				  reference image, used by the Etaluma adapter to deliver
+//				  only the frames in which something happened.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _CHANGEDETECTOR_H_
+#define _CHANGEDETECTOR_H_
+
+#include <vector>
+
+class ChangeDetector
+{
+public:
+	static const unsigned TILE_SIZE = 64;
+
+	ChangeDetector();
+
+	// Compare images of width x height with bytesPerPixel 1 or 2, using
+	// every rowStep-th row. Forgets the reference.
+	void Configure(unsigned width, unsigned height, unsigned bytesPerPixel, unsigned rowStep);
+
+	bool HasReference() const { return hasReference_; }
+	void SetReference(const unsigned char* image);
+
+	// Largest mean absolute difference to the reference over the tiles of
+	// TILE_SIZE x TILE_SIZE pixels, in grey levels of the image. Taking the
+	// worst tile keeps a small change from being averaged away by a quiet
+	// rest of the frame.
+	double Score(const unsigned char* image);
+
+private:
+	static unsigned RowSad8(const unsigned char* a, const unsigned char* b, unsigned n);
+	static unsigned RowSad16(const unsigned short* a, const unsigned short* b, unsigned n);
+
+	unsigned width_;
+	unsigned height_;
+	unsigned bytesPerPixel_;
+	unsigned rowStep_;
+	unsigned tilesX_;
+	unsigned tilesY_;
+	bool hasReference_;
+	std::vector<unsigned char> reference_;		// the compared rows only
+	std::vector<unsigned long long> tileSums_;
+	std::vector<unsigned> tilePixels_;
+};
+
+#endif //_CHANGEDETECTOR_H_
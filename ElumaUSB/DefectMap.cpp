@@ -0,0 +1,215 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DefectMap.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hot and dead pixel map of the Etaluma sensor.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "DefectMap.h"
+#include <algorithm>
+#include <fstream>
+
+using namespace std;
+
+bool DefectMap::Configuration::operator<(const Configuration& other) const
+{
+	if (roiX != other.roiX) return roiX < other.roiX;
+	if (roiY != other.roiY) return roiY < other.roiY;
+	if (width != other.width) return width < other.width;
+	if (height != other.height) return height < other.height;
+	return binning < other.binning;
+}
+
+DefectMap::DefectMap() :
+	sensorWidth_(0),
+	sensorHeight_(0),
+	pass_(0),
+	uses_(0)
+{
+}
+
+void DefectMap::SetSensorSize(unsigned width, unsigned height)
+{
+	if (width != sensorWidth_ || height != sensorHeight_) {
+		sensorWidth_ = width;
+		sensorHeight_ = height;
+		Clear();
+	}
+}
+
+// Mean of the 4-neighbours of (x, y) that lie on the sensor.
+static unsigned NeighbourMean(const unsigned char* frame, unsigned width, unsigned height, unsigned x, unsigned y)
+{
+	unsigned sum = 0, n = 0;
+	if (x > 0) { sum += frame[y * width + x - 1]; n++; }
+	if (x + 1 < width) { sum += frame[y * width + x + 1]; n++; }
+	if (y > 0) { sum += frame[(y - 1) * width + x]; n++; }
+	if (y + 1 < height) { sum += frame[(y + 1) * width + x]; n++; }
+	return n ? (sum + n / 2) / n : frame[y * width + x];
+}
+
+void DefectMap::DetectDark(const unsigned char* frame, unsigned threshold)
+{
+	dark_.clear();
+	for (unsigned y = 0; y < sensorHeight_; y++) {
+		for (unsigned x = 0; x < sensorWidth_; x++) {
+			unsigned value = frame[y * sensorWidth_ + x];
+			if (value > NeighbourMean(frame, sensorWidth_, sensorHeight_, x, y) + threshold)
+				dark_.push_back(y * sensorWidth_ + x);
+		}
+	}
+	Merge();
+}
+
+void DefectMap::DetectFlat(const unsigned char* frame)
+{
+	flat_.clear();
+	for (unsigned y = 0; y < sensorHeight_; y++) {
+		for (unsigned x = 0; x < sensorWidth_; x++) {
+			unsigned value = 2 * frame[y * sensorWidth_ + x];
+			unsigned mean = NeighbourMean(frame, sensorWidth_, sensorHeight_, x, y);
+			if (mean >= MIN_FLAT_MEAN && (value < mean || value > 3 * mean))
+				flat_.push_back(y * sensorWidth_ + x);
+		}
+	}
+	Merge();
+}
+
+void DefectMap::Clear()
+{
+	dark_.clear();
+	flat_.clear();
+	Merge();
+}
+
+void DefectMap::Merge()
+{
+	defects_.clear();
+	set_union(dark_.begin(), dark_.end(), flat_.begin(), flat_.end(), back_inserter(defects_));
+	selections_.clear();
+}
+
+// Text file, "ETLDEF01 width height" followed by one "x y" line per defect.
+bool DefectMap::Load(const string& path)
+{
+	ifstream file(path.c_str());
+	string magic;
+	unsigned width, height;
+	if (!(file >> magic >> width >> height) || magic != "ETLDEF01" ||
+		width != sensorWidth_ || height != sensorHeight_)
+		return false;
+
+	vector<unsigned> defects;
+	unsigned x, y;
+	while (file >> x >> y) {
+		if (x < width && y < height)
+			defects.push_back(y * width + x);
+	}
+	sort(defects.begin(), defects.end());
+	defects.erase(unique(defects.begin(), defects.end()), defects.end());
+
+	// The file does not say how a defect was found, so it is kept with the
+	// dark ones; a new dark capture replaces it.
+	dark_ = defects;
+	flat_.clear();
+	Merge();
+	return true;
+}
+
+bool DefectMap::Save(const string& path) const
+{
+	ofstream file(path.c_str());
+	file << "ETLDEF01 " << sensorWidth_ << " " << sensorHeight_ << endl;
+	for (size_t i = 0; i < defects_.size(); i++)
+		file << defects_[i] % sensorWidth_ << " " << defects_[i] / sensorWidth_ << endl;
+	return file.good();
+}
+
+const vector<unsigned>& DefectMap::Select(unsigned roiX, unsigned roiY, unsigned width, unsigned height, unsigned binning)
+{
+	Configuration key = { roiX, roiY, width, height, binning };
+	map<Configuration, Selection>::iterator it = selections_.find(key);
+	if (it != selections_.end()) {
+		it->second.pass = pass_;
+		it->second.lastUse = ++uses_;
+		return it->second.defects;
+	}
+
+	// Map nodes stay put when others are erased, so making room first
+	// leaves the lists handed out in this pass alone.
+	Evict();
+	Selection& entry = selections_[key];
+	entry.pass = pass_;
+	entry.lastUse = ++uses_;
+
+	// A binned pixel is defective if any of its sensor pixels is. Sensor
+	// indices are row major, so the mapped indices come out nearly sorted.
+	vector<unsigned>& selection = entry.defects;
+	for (size_t i = 0; i < defects_.size(); i++) {
+		unsigned x = (defects_[i] % sensorWidth_) / binning;
+		unsigned y = (defects_[i] / sensorWidth_) / binning;
+		if (x >= roiX && x < roiX + width && y >= roiY && y < roiY + height)
+			selection.push_back((y - roiY) * width + (x - roiX));
+	}
+	sort(selection.begin(), selection.end());
+	selection.erase(unique(selection.begin(), selection.end()), selection.end());
+	return selection;
+}
+
+// Drop the least recently used selections not used in the current pass
+// until there is room for one more.
+void DefectMap::Evict()
+{
+	while (selections_.size() >= CACHED_CONFIGURATIONS) {
+		map<Configuration, Selection>::iterator oldest = selections_.end();
+		for (map<Configuration, Selection>::iterator it = selections_.begin(); it != selections_.end(); ++it) {
+			if (it->second.pass != pass_ && (oldest == selections_.end() || it->second.lastUse < oldest->second.lastUse))
+				oldest = it;
+		}
+		if (oldest == selections_.end())
+			return;
+		selections_.erase(oldest);
+	}
+}
+
+void DefectMap::Correct(unsigned char* image, unsigned width, unsigned height, const vector<unsigned>& defects)
+{
+	for (size_t i = 0; i < defects.size(); i++)
+		CorrectPixel(image, width, height, width, defects, i);
+}
+
+void DefectMap::CorrectPixel(unsigned char* image, unsigned width, unsigned height, size_t stride,
+	const vector<unsigned>& defects, size_t i)
+{
+	unsigned index = defects[i];
+	unsigned x = index % width;
+	unsigned y = index / width;
+	unsigned char* pixel = image + y * stride + x;
+
+	// Neighbours that are defects themselves do not count. The list is
+	// sorted, so the row neighbours are adjacent entries and the others
+	// are found by binary search.
+	unsigned sum = 0, n = 0;
+	if (x > 0 && !(i > 0 && defects[i - 1] == index - 1)) { sum += pixel[-1]; n++; }
+	if (x + 1 < width && !(i + 1 < defects.size() && defects[i + 1] == index + 1)) { sum += pixel[1]; n++; }
+	if (y > 0 && !binary_search(defects.begin(), defects.begin() + i, index - width)) { sum += *(pixel - stride); n++; }
+	if (y + 1 < height && !binary_search(defects.begin() + i, defects.end(), index + width)) { sum += pixel[stride]; n++; }
+
+	if (n > 0)
+		*pixel = (unsigned char)((sum + n / 2) / n);
+}
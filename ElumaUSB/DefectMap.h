@@ -0,0 +1,109 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          DefectMap.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hot and dead pixel map of the Etaluma sensor. Defects are
+//				  found in dark and flat captures and kept as a sorted list
+//				  of sensor pixel indices. For each ROI and binning the list
+//				  is mapped to image indices once, so correcting a frame
+//				  only touches the defective pixels.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _DEFECTMAP_H_
+#define _DEFECTMAP_H_
+
+#include <vector>
+#include <map>
+#include <string>
+
+class DefectMap
+{
+public:
+	// Neighbour mean below which DetectFlat leaves a pixel alone. Too dark
+	// to tell a dead pixel from shot noise, and a zero mean would make any
+	// lit pixel look hot.
+	static const unsigned MIN_FLAT_MEAN = 32;
+
+	// Configurations whose selections are kept once no longer in use.
+	static const size_t CACHED_CONFIGURATIONS = 8;
+
+	DefectMap();
+
+	void SetSensorSize(unsigned width, unsigned height);
+
+	// Find pixels that stand out from their neighbours. In a dark frame a
+	// pixel more than threshold grey levels above its neighbours is hot. In
+	// a flat frame a pixel below half or above one and a half times its
+	// neighbours, if they average MIN_FLAT_MEAN or more, is dead or hot.
+	// Each call replaces the previous result of
+	// the same kind. Frames are 8 bit and cover the full sensor.
+	void DetectDark(const unsigned char* frame, unsigned threshold);
+	void DetectFlat(const unsigned char* frame);
+	void Clear();
+
+	size_t Count() const { return defects_.size(); }
+
+	bool Load(const std::string& path);
+	bool Save(const std::string& path) const;
+
+	// Defects inside a ROI at a binning, as sorted indices into the
+	// width x height image. ROI coordinates are in binned pixels. The list
+	// is computed once per configuration and cached. Lists selected since
+	// the last BeginSelect stay valid until the next one; older ones may be
+	// evicted to keep the cache to CACHED_CONFIGURATIONS entries.
+	void BeginSelect() { pass_++; }
+	const std::vector<unsigned>& Select(unsigned roiX, unsigned roiY, unsigned width, unsigned height, unsigned binning);
+
+	// Replace each listed pixel of an 8 bit image by the mean of its good
+	// 4-neighbours.
+	static void Correct(unsigned char* image, unsigned width, unsigned height, const std::vector<unsigned>& defects);
+
+	// Correct defects[i] alone. Its neighbours must be final already, apart
+	// from other defects, which are skipped. The rows of image are stride
+	// bytes apart, the indices still count width pixels per row.
+	static void CorrectPixel(unsigned char* image, unsigned width, unsigned height, size_t stride,
+		const std::vector<unsigned>& defects, size_t i);
+
+private:
+	struct Configuration
+	{
+		unsigned roiX, roiY, width, height, binning;
+		bool operator<(const Configuration& other) const;
+	};
+
+	struct Selection
+	{
+		std::vector<unsigned> defects;
+		unsigned long long pass;		// BeginSelect pass that last used it
+		unsigned long long lastUse;
+	};
+
+	void Merge();
+	void Evict();
+
+	unsigned sensorWidth_;
+	unsigned sensorHeight_;
+	std::vector<unsigned> dark_;
+	std::vector<unsigned> flat_;
+	std::vector<unsigned> defects_;		// union of both, sorted sensor indices
+	std::map<Configuration, Selection> selections_;
+	unsigned long long pass_;
+	unsigned long long uses_;
+};
+
+#endif //_DEFECTMAP_H_
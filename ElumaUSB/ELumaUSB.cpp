@@ -73,11 +73,21 @@ class __declspec(dllexport) ELumaUSB {
 		return descriptionVector;
 	}
 
+	// Copies the latest reassembled frame into cBuffer. On entry *count must
+	// hold the capacity of cBuffer, on return it holds the size of the frame.
+	// Returns true only if LumaUSB reported a complete frame that fit.
 	public: bool GetLatest24bppBuffer(unsigned char* cBuffer, int* count) {
 		cli::array<unsigned char>^ buffer;
 		bool isFull = _private->lumaUSB->GetLatest24bppBuffer(buffer);
-		pin_ptr<unsigned char> pinnedArray = &buffer[0];
-		cBuffer = pinnedArray;
+		if (buffer == nullptr) {
+			*count = 0;
+			return false;
+		}
+		if (buffer->Length > *count) {
+			*count = buffer->Length;
+			return false;
+		}
+		Marshal::Copy(buffer, 0, System::IntPtr(cBuffer), buffer->Length);
 		*count = buffer->Length;
 		return isFull;
 	}
@@ -121,7 +131,7 @@ class __declspec(dllexport) ELumaUSB {
 	}
 
 	public: void ISOStreamStop() {
-		_private->lumaUSB->ISOStreamStart();
+		_private->lumaUSB->ISOStreamStop();
 	}
 
 	public: bool LedControllerWrite(unsigned char ledId, unsigned char brightness) {
@@ -28,6 +28,11 @@
 #include "MMDeviceConstants.h"
 #include "ModuleInterface.h"
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <thread>
 
 using namespace std;
 
@@ -35,12 +40,230 @@ const char* g_CameraName = "LS600";
 
 const char* g_CameraModelProperty = "Model";
 
-const char* g_CameraModel_600 = "Lumascope 600/700";
+const char* g_CameraModel_600 = "Lumascope 600";
+
+const char* g_CameraModel_700 = "Lumascope 700";
 
 const char* g_PixelType_8bit = "8bit";
 
 const char* g_PixelClockMHz = "Pixel Clock MHz";
 
+const char* g_SnapMode = "Snap Mode";
+
+const char* g_SnapMode_OnDemand = "On Demand";
+
+const char* g_SnapMode_WarmStream = "Warm Stream";
+
+const char* g_FrameAveraging = "Frame Averaging";
+
+const char* g_FrameAveraging_Off = "Off";
+
+const char* g_FrameAveraging_Average = "Average";
+
+const char* g_FrameAveraging_Sum = "Sum";
+
+const char* g_FrameAveraging_Running = "Running Average";
+
+const char* g_FramesToAverage = "Frames To Average";
+
+const char* g_FrameQueueLength = "Frame Queue Length";
+
+const char* g_OverflowPolicy = "Frame Queue Overflow Policy";
+
+const char* g_OverflowPolicy_DropOldest = "Drop Oldest";
+
+const char* g_OverflowPolicy_DropNewest = "Drop Newest";
+
+const char* g_OverflowPolicy_Block = "Block";
+
+const char* g_OverflowPolicy_Stop = "Stop Acquisition";
+
+const char* g_FrameQueueOccupancy = "Frame Queue Occupancy";
+
+const char* g_FramesDropped = "Frames Dropped";
+
+const char* g_Keyword_UsbFrameNumber = "USB Frame Number";
+
+const char* g_TransportThreadCpu = "Transport Thread CPU";
+
+const char* g_ProcessingThreadCpu = "Processing Thread CPU";
+
+const char* g_ThreadPriority = "Acquisition Thread Priority";
+
+const char* g_ThreadPriority_Normal = "Normal";
+
+const char* g_ThreadPriority_AboveNormal = "Above Normal";
+
+const char* g_ThreadPriority_Highest = "Highest";
+
+const char* g_ThreadPriority_TimeCritical = "Time Critical";
+
+const char* g_NumaLocalPool = "NUMA Local Frame Pool";
+
+const char* g_LatencyP50 = "Frame Latency p50 ms";
+
+const char* g_LatencyP99 = "Frame Latency p99 ms";
+
+const char* g_Keyword_FrameLatency = "Frame Latency ms";
+
+const char* g_Off = "Off";
+
+const char* g_On = "On";
+
+// Thread selectors for OnThreadCpu
+const long g_TransportThread = 0;
+
+const long g_ProcessingThread = 1;
+
+const char* g_LedSequence = "LED Sequence";
+
+const char* g_LedSettleFrames = "LED Settle Frames";
+
+const char* g_Keyword_LedChannel = "LED Channel";
+
+const char* g_Keyword_LedBrightness = "LED Brightness";
+
+const char* g_PreviewDecimation = "Preview Decimation";
+
+const char* g_PreviewMaxFps = "Preview Max FPS";
+
+const char* g_RecordingFile = "Recording File";
+
+const char* g_Keyword_FramesRecorded = "Frames Recorded";
+
+const char* g_IntervalPreWarm = "Interval Pre-Warm ms";
+
+const char* g_IdleBetweenFrames = "Idle Stream Between Frames";
+
+const char* g_ScheduleJitter = "Schedule Jitter ms";
+
+const char* g_ScheduleErrorMax = "Schedule Error Max ms";
+
+const char* g_Keyword_ScheduleError = "Schedule Error ms";
+
+const char* g_CalibrationFile = "Calibration File";
+
+const char* g_CalibratePixelClock = "Pixel Clock Calibration";
+
+const char* g_CalibratePixelClock_Idle = "Idle";
+
+const char* g_CalibratePixelClock_Run = "Run";
+
+const char* g_CalibrationResult = "Pixel Clock Calibration Result";
+
+const char* g_StreamCaptureFile = "Stream Capture File";
+
+const char* g_StreamCaptureDropped = "Stream Capture Frames Dropped";
+
+const char* g_ReplayFile = "Replay File";
+
+const char* g_ReplaySpeed = "Replay Speed";
+
+const char* g_ReplaySpeed_Original = "Original";
+
+const char* g_ReplaySpeed_Fast = "As Fast As Possible";
+
+const char* g_DefectMapFile = "Defect Map File";
+
+const char* g_DefectCorrection = "Defect Correction";
+
+const char* g_DefectMapCapture = "Defect Map Capture";
+
+const char* g_DefectMapCapture_Idle = "Idle";
+
+const char* g_DefectMapCapture_Dark = "Dark";
+
+const char* g_DefectMapCapture_Flat = "Flat";
+
+const char* g_DefectMapCapture_Clear = "Clear";
+
+const char* g_DefectThreshold = "Defect Threshold";
+
+const char* g_DefectCount = "Defect Count";
+
+const char* g_MonoConversion = "Mono Conversion";
+
+const char* g_MonoConversion_Luminance = "Luminance";
+
+const char* g_MonoConversion_Green = "Green";
+
+const char* g_FrameStatistics = "Frame Statistics";
+
+const char* g_RoiList = "ROI List";
+
+const char* g_RoiOutput = "ROI Output";
+
+const char* g_RoiOutput_Packed = "Packed";
+
+const char* g_RoiOutput_Tagged = "Tagged";
+
+const char* g_Keyword_RoiIndex = "ROI Index";
+
+const char* g_Keyword_Roi = "ROI";
+
+const char* g_SharedMemoryRing = "Shared Memory Ring";
+
+const char* g_SharedMemorySlots = "Shared Memory Slots";
+
+const char* g_SharedMemoryFrames = "Shared Memory Frames Published";
+
+const char* g_SharedMemoryThroughput = "Shared Memory Throughput MB/s";
+
+const char* g_Keyword_SettingsGeneration = "Settings Generation";
+
+const char* g_StripRows = "Strip Rows";
+
+const char* g_ChangeTrigger = "Change Trigger";
+
+const char* g_ChangeThreshold = "Change Threshold";
+
+const char* g_ChangeRowStep = "Change Row Step";
+
+const char* g_PreTriggerFrames = "Change Pre-Trigger Frames";
+
+const char* g_PostTriggerFrames = "Change Post-Trigger Frames";
+
+const char* g_ChangeScore = "Change Score";
+
+const char* g_ChangeFramesSkipped = "Change Frames Skipped";
+
+const char* g_Keyword_ChangeTrigger = "Change Trigger";
+
+const char* g_Trace = "Trace";
+
+const char* g_TraceFile = "Trace File";
+
+const char* g_TraceEventsWritten = "Trace Events Written";
+
+const char* g_TraceEventsLost = "Trace Events Lost";
+
+// Values of g_Keyword_ChangeTrigger, indexed by Etaluma::Trigger.
+const char* const g_ChangeTriggerLabels[] = { "", "Pre", "Trigger", "Post" };
+
+// Metadata key prefixes of the statistics, indexed by FrameKernel::Stats
+// channel.
+const char* const g_StatisticsChannels[FrameKernel::Stats::CHANNEL_COUNT] =
+{
+	"Statistics Blue",
+	"Statistics Green",
+	"Statistics Red",
+	"Statistics Image"
+};
+
+// Upper bound on how long the acquisition thread waits for LumaUSB to hand
+// over a complete frame before giving up.
+const double g_FrameTimeoutMs = 5000.0;
+
+// Time spent measuring each pixel clock during calibration.
+const double g_CalibrationMs = 2000.0;
+
+// Frames averaged into a dark or flat capture for defect detection.
+const int g_DefectCaptureFrames = 16;
+
+// A clock that needs this much more USB traffic per delivered frame than the
+// leanest one lost frames inside LumaUSB.
+const double g_CalibrationExcessBytes = 1.1;
+
 
 int main() {
 	cout << "Initializing LumaUSB...";
@@ -92,14 +315,76 @@ Etaluma::Etaluma() :
 	bytesPerPixel_(1),
 	initialized_(false),
 	exposureMs_(10.0),
+	currentClockIndex_(0),
 	roiX_(0),
 	roiY_(0),
 	thd_(0),
+	transportThd_(0),
+	stopOnOverflow_(false),
+	overflowPolicy_(FrameQueue::OVERFLOW_DROP_OLDEST),
+	frameQueueLength_(8),
+	haveFrame_(false),
+	transportCpu_(-1),
+	processingCpu_(-1),
+	threadPriority_(ThreadScheduling::PRIORITY_NORMAL),
+	numaLocalPool_(false),
+	lastFrameTimeUs_(0),
+	lastFrameNumber_(0),
+	sensor_(0),
 	IMAGE_HEIGHT(1200),
 	IMAGE_WIDTH(1200),
 	MAX_BIT_DEPTH(8),
-	busy_(false)
+	busy_(false),
+	streaming_(false),
+	warmStream_(false),
+	warmIdle_(false),
+	framePeriodMs_(0),
+	averagingMode_(FrameAccumulator::MODE_OFF),
+	framesToAverage_(1),
+	ledSettleFrames_(1),
+	currentLedStep_(-1),
+	activeLedId_(-1),
+	previewDecimation_(1),
+	previewOutput_(false),
+	previewMaxFps_(0),
+	lastPreviewUs_(0),
+	sequenceStartUs_(0),
+	preWarmMs_(250),
+	idleBetweenFrames_(true),
+	scheduled_(false),
+	scheduleErrorMs_(0),
+	scheduleCount_(0),
+	scheduleMeanMs_(0),
+	scheduleM2_(0),
+	scheduleMaxMs_(0),
+	activeDefects_(0),
+	defectCorrection_(false),
+	defectThreshold_(32),
+	monoFormat_(FrameKernel::FORMAT_LUMINANCE),
+	kernel_(0),
+	frameStats_(false),
+	roiTagged_(false),
+	sharedRingSlots_(8),
+	settingsGeneration_(0),
+	previousSettingsGeneration_(0),
+	settingsAppliedUs_(0),
+	stripRows_(0),
+	stripDst_(0),
+	changeTrigger_(false),
+	changeThreshold_(4.0),
+	changeRowStep_(4),
+	preTriggerFrames_(4),
+	postTriggerFrames_(4),
+	postTriggerLeft_(0),
+	preTriggerStart_(0),
+	preTriggerCount_(0),
+	changeScore_(0),
+	changeSkipped_(0),
+	traceFile_("EtalumaTrace.json")
 {
+	imageTag_ = ImageTag();
+	imageTag_.ledStep = -1;
+
 	// call the base class method to set-up default error codes/messages
 	InitializeDefaultErrorMessages();
 
@@ -113,12 +398,27 @@ Etaluma::Etaluma() :
 
 	vector<string> modelValues;
 	modelValues.push_back(g_CameraModel_600);
+	modelValues.push_back(g_CameraModel_700);
 
 	ret = SetAllowedValues(g_CameraModelProperty, modelValues);
 	assert(ret == DEVICE_OK);
 
+	// Where the pixel clock calibration of this host is kept.
+	ret = CreateProperty(g_CalibrationFile, "EtalumaPixelClock.txt", MM::String, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	// Stream file to play back instead of talking to a microscope. Empty
+	// uses the hardware.
+	ret = CreateProperty(g_ReplayFile, "", MM::String, false, 0, true);
+	assert(ret == DEVICE_OK);
+
+	// Where the defect pixel map of this camera is kept.
+	ret = CreateProperty(g_DefectMapFile, "EtalumaDefects.txt", MM::String, false, 0, true);
+	assert(ret == DEVICE_OK);
+
 	// create live video thread
 	thd_ = new SequenceThread(this);
+	transportThd_ = new TransportThread(this);
 }
 
 /********************************************************************************
@@ -130,6 +430,8 @@ Etaluma::~Etaluma()
 		Shutdown();
 
 	delete thd_;
+	delete transportThd_;
+	delete sensor_;
 }
 
 // Get the name of the camera. NJS 2015-11-16
@@ -157,33 +459,57 @@ int Etaluma::Initialize()
 	if (initialized_)
 		return DEVICE_OK;
 
+	// Native description of the sensor for the selected model. Register
+	// addresses and limits are compile-time constants, so only the USB IDs
+	// below have to be fetched from LumaUSB.dll.
+	char model[MM::MaxStrLength];
+	GetProperty(g_CameraModelProperty, model);
+	delete sensor_;
+	if (strcmp(model, g_CameraModel_700) == 0)
+		sensor_ = new EtalumaSensor::ImageSensor<EtalumaSensor::Lumascope700>(lumaUSB);
+	else
+		sensor_ = new EtalumaSensor::ImageSensor<EtalumaSensor::Lumascope600>(lumaUSB);
+
+	IMAGE_WIDTH = sensor_->ImageWidth();
+	IMAGE_HEIGHT = sensor_->ImageHeight();
+	MAX_BIT_DEPTH = sensor_->BitDepth();
+
 	// Constants for the Etaluma microscope.
 	PID_LSCOPE = lumaUSB.PID_LSCOPE();
 	VID_CYPRESS = lumaUSB.VID_CYPRESS();
-	IMAGE_SENSOR_BLUE_GAIN = lumaUSB.IMAGE_SENSOR_BLUE_GAIN();
-	IMAGE_SENSOR_GLOBAL_GAIN = lumaUSB.IMAGE_SENSOR_GLOBAL_GAIN();
-	IMAGE_SENSOR_GREEN1_GAIN = lumaUSB.IMAGE_SENSOR_GREEN1_GAIN();
-	IMAGE_SENSOR_GREEN2_GAIN = lumaUSB.IMAGE_SENSOR_GREEN2_GAIN();
-	IMAGE_SENSOR_RED_GAIN = lumaUSB.IMAGE_SENSOR_RED_GAIN();
-	IMAGE_SENSOR_RESET = lumaUSB.IMAGE_SENSOR_RESET();
-	IMAGE_SENSOR_SHUTTER_WIDTH_LOWER = lumaUSB.IMAGE_SENSOR_SHUTTER_WIDTH_LOWER();
-	MAX_GLOBAL_GAIN_PARAMETER_VALUE = lumaUSB.MAX_GLOBAL_GAIN_PARAMETER_VALUE();
-	MAX_IMAGE_SENSOR_EXPOSURE = lumaUSB.MAX_IMAGE_SENSOR_EXPOSURE();
-	RECOMMENDED_MIN_GLOBAL_GAIN_PARAMETER_VALUE = lumaUSB.RECOMMENDED_MIN_GLOBAL_GAIN_PARAMETER_VALUE();
 
 	// Grab the range of pixel clock frequencies
-	for (int i = 0; i < lumaUSB.GetPixelClockDescriptionCount(); i++) {
-		clockFreqMHz_.push_back(lumaUSB.GetPixelClockDescription(i));
+	clockFreqMHz_.clear();
+	for (int i = 0; i < sensor_->PixelClockCount(); i++) {
+		clockFreqMHz_.push_back(sensor_->PixelClockDescription(i));
 	}
 
-	// Create the external Lumascope camera object.
-	lumaUSB = ELumaUSB(VID_CYPRESS, PID_LSCOPE, IMAGE_WIDTH, IMAGE_HEIGHT);
+	// A replay stands in for the camera, so no device is needed.
+	char replayFile[MM::MaxStrLength];
+	GetProperty(g_ReplayFile, replayFile);
+	if (strlen(replayFile) > 0) {
+		if (!replay_.Open(replayFile) ||
+			replay_.Width() != (unsigned)IMAGE_WIDTH || replay_.Height() != (unsigned)IMAGE_HEIGHT)
+			return ERR_REPLAY_FILE;
+	}
+	else {
+		// The limits programmed below come from the native description, so a
+		// library for other hardware must not get this far.
+		string mismatch;
+		if (!sensor_->MatchesLibrary(lumaUSB, mismatch)) {
+			LogMessage("Native sensor description does not match LumaUSB.dll: " + mismatch + " differs", false);
+			return ERR_SENSOR_MISMATCH;
+		}
 
-	// Search for uninitialized cameras first, then search for initialized
-	// cameras.
-	if (!lumaUSB.findUninitializedCamera()) {
-		if (!lumaUSB.findInitializedCamera()) {
-			return DEVICE_NOT_CONNECTED;
+		// Create the external Lumascope camera object.
+		lumaUSB = ELumaUSB(VID_CYPRESS, PID_LSCOPE, IMAGE_WIDTH, IMAGE_HEIGHT);
+
+		// Search for uninitialized cameras first, then search for initialized
+		// cameras.
+		if (!lumaUSB.findUninitializedCamera()) {
+			if (!lumaUSB.findInitializedCamera()) {
+				return DEVICE_NOT_CONNECTED;
+			}
 		}
 	}
 
@@ -193,34 +519,450 @@ int Etaluma::Initialize()
 
 	// GAIN
 	CPropertyAction* pAct = new CPropertyAction(this, &Etaluma::OnGain);
-	int ret = CreateProperty(MM::g_Keyword_Gain, reinterpret_cast<char*>(&RECOMMENDED_MIN_GLOBAL_GAIN_PARAMETER_VALUE), MM::Integer, false, pAct);
+	int ret = CreateProperty(MM::g_Keyword_Gain, CDeviceUtils::ConvertToString((long)sensor_->RecommendedMinGlobalGain()), MM::Integer, false, pAct);
 	assert(ret == DEVICE_OK);
-	SetPropertyLimits(MM::g_Keyword_Gain, 0, 222);
+	SetPropertyLimits(MM::g_Keyword_Gain, 0, sensor_->MaxGlobalGain());
 
 	// EXPOSURE
 	pAct = new CPropertyAction(this, &Etaluma::OnExposure);
 	ret = CreateProperty(MM::g_Keyword_Exposure, "10", MM::Float, false, pAct);
 	assert(ret == DEVICE_OK);
-	SetPropertyLimits(MM::g_Keyword_Exposure, 0, MAX_IMAGE_SENSOR_EXPOSURE);
+	SetPropertyLimits(MM::g_Keyword_Exposure, 0, sensor_->MaxExposure());
 
 	// PIXEL CLOCK FREQUENCY
+	// Start from the calibrated clock for this host if there is one.
+	char calibrationFile[MM::MaxStrLength];
+	GetProperty(g_CalibrationFile, calibrationFile);
+	calibrationFile_ = calibrationFile;
+
+	currentClockFreqMHz_ = clockFreqMHz_[0];
+	string calibratedClock;
+	if (LoadPixelClockCalibration(calibratedClock)) {
+		vector<string>::const_iterator it = find(clockFreqMHz_.begin(), clockFreqMHz_.end(), calibratedClock);
+		if (it != clockFreqMHz_.end()) {
+			ret = SetPixelClock((int)(it - clockFreqMHz_.begin()));
+			if (ret != DEVICE_OK)
+				return ret;
+		}
+	}
+
 	pAct = new CPropertyAction(this, &Etaluma::OnPixelClock);
-	ret = CreateProperty(g_PixelClockMHz,clockFreqMHz_[0].c_str(), MM::String, false, pAct);
+	ret = CreateProperty(g_PixelClockMHz, currentClockFreqMHz_.c_str(), MM::String, false, pAct);
 	assert(ret == DEVICE_OK);
 	ret = SetAllowedValues(g_PixelClockMHz, clockFreqMHz_);
 	assert(ret == DEVICE_OK);
 
-	// BINNING - not yet implemented
-	/*CPropertyAction *pAct = new CPropertyAction(this, &Etaluma::OnBinning);
-	int ret = CreateProperty(MM::g_Keyword_Binning, "1", MM::Integer, false, pAct);
+	// Setting this to Run streams briefly at every pixel clock, then selects
+	// and saves the fastest one that delivered every frame intact.
+	pAct = new CPropertyAction(this, &Etaluma::OnCalibratePixelClock);
+	ret = CreateProperty(g_CalibratePixelClock, g_CalibratePixelClock_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> calibrateValues;
+	calibrateValues.push_back(g_CalibratePixelClock_Idle);
+	calibrateValues.push_back(g_CalibratePixelClock_Run);
+	ret = SetAllowedValues(g_CalibratePixelClock, calibrateValues);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnCalibrationResult);
+	ret = CreateProperty(g_CalibrationResult, "", MM::String, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	// STREAM CAPTURE AND REPLAY
+	// Setting a capture file records every frame LumaUSB delivers, and the
+	// control writes in between, until the file name is cleared. Frames the
+	// disk could not keep up with are dropped from the capture, never from
+	// the acquisition, and counted.
+	pAct = new CPropertyAction(this, &Etaluma::OnStreamCaptureFile);
+	ret = CreateProperty(g_StreamCaptureFile, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnStreamCaptureDropped);
+	ret = CreateProperty(g_StreamCaptureDropped, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	if (replay_.IsOpen()) {
+		pAct = new CPropertyAction(this, &Etaluma::OnReplaySpeed);
+		ret = CreateProperty(g_ReplaySpeed, g_ReplaySpeed_Original, MM::String, false, pAct);
+		assert(ret == DEVICE_OK);
+
+		vector<string> speedValues;
+		speedValues.push_back(g_ReplaySpeed_Original);
+		speedValues.push_back(g_ReplaySpeed_Fast);
+		ret = SetAllowedValues(g_ReplaySpeed, speedValues);
+		assert(ret == DEVICE_OK);
+	}
+
+	// SNAP MODE
+	// In warm stream mode the ISO stream keeps running between acquisitions
+	// and snaps are served from it.
+	pAct = new CPropertyAction(this, &Etaluma::OnSnapMode);
+	ret = CreateProperty(g_SnapMode, g_SnapMode_OnDemand, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> snapModeValues;
+	snapModeValues.push_back(g_SnapMode_OnDemand);
+	snapModeValues.push_back(g_SnapMode_WarmStream);
+	ret = SetAllowedValues(g_SnapMode, snapModeValues);
+	assert(ret == DEVICE_OK);
+
+	// FRAME AVERAGING
+	// Average or sum N frames inside the adapter, or smooth live view with a
+	// running average. Sum mode switches the image to 16 bit.
+	pAct = new CPropertyAction(this, &Etaluma::OnFrameAveraging);
+	ret = CreateProperty(g_FrameAveraging, g_FrameAveraging_Off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> averagingValues;
+	averagingValues.push_back(g_FrameAveraging_Off);
+	averagingValues.push_back(g_FrameAveraging_Average);
+	averagingValues.push_back(g_FrameAveraging_Sum);
+	averagingValues.push_back(g_FrameAveraging_Running);
+	ret = SetAllowedValues(g_FrameAveraging, averagingValues);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnFramesToAverage);
+	ret = CreateProperty(g_FramesToAverage, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_FramesToAverage, 1, 1024);
+
+	// FRAME QUEUE
+	// Frames travel from the transport thread to the acquisition thread
+	// through a bounded queue. Changes apply the next time the stream starts.
+	pAct = new CPropertyAction(this, &Etaluma::OnFrameQueueLength);
+	ret = CreateProperty(g_FrameQueueLength, "8", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_FrameQueueLength, 2, 64);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnOverflowPolicy);
+	ret = CreateProperty(g_OverflowPolicy, g_OverflowPolicy_DropOldest, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> policyValues;
+	policyValues.push_back(g_OverflowPolicy_DropOldest);
+	policyValues.push_back(g_OverflowPolicy_DropNewest);
+	policyValues.push_back(g_OverflowPolicy_Block);
+	policyValues.push_back(g_OverflowPolicy_Stop);
+	ret = SetAllowedValues(g_OverflowPolicy, policyValues);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnFrameQueueOccupancy);
+	ret = CreateProperty(g_FrameQueueOccupancy, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnFramesDropped);
+	ret = CreateProperty(g_FramesDropped, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	// THREAD SCHEDULING
+	// Pin the transport and acquisition threads to chosen cores, raise their
+	// priority and place the frame pool on the matching NUMA node. Takes
+	// effect the next time the stream starts.
+	CPropertyActionEx* pActEx = new CPropertyActionEx(this, &Etaluma::OnThreadCpu, g_TransportThread);
+	ret = CreateProperty(g_TransportThreadCpu, "-1", MM::Integer, false, pActEx);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_TransportThreadCpu, -1, 63);
+
+	pActEx = new CPropertyActionEx(this, &Etaluma::OnThreadCpu, g_ProcessingThread);
+	ret = CreateProperty(g_ProcessingThreadCpu, "-1", MM::Integer, false, pActEx);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_ProcessingThreadCpu, -1, 63);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnThreadPriority);
+	ret = CreateProperty(g_ThreadPriority, g_ThreadPriority_Normal, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> priorityValues;
+	priorityValues.push_back(g_ThreadPriority_Normal);
+	priorityValues.push_back(g_ThreadPriority_AboveNormal);
+	priorityValues.push_back(g_ThreadPriority_Highest);
+	priorityValues.push_back(g_ThreadPriority_TimeCritical);
+	ret = SetAllowedValues(g_ThreadPriority, priorityValues);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnNumaLocalPool);
+	ret = CreateProperty(g_NumaLocalPool, g_Off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> offOnValues;
+	offOnValues.push_back(g_Off);
+	offOnValues.push_back(g_On);
+	ret = SetAllowedValues(g_NumaLocalPool, offOnValues);
+	assert(ret == DEVICE_OK);
+
+	// Latency from frame arrival to InsertImage over the last sequence, to
+	// judge the effect of the scheduling settings.
+	pActEx = new CPropertyActionEx(this, &Etaluma::OnLatencyPercentile, 50);
+	ret = CreateProperty(g_LatencyP50, "0", MM::Float, true, pActEx);
+	assert(ret == DEVICE_OK);
+
+	pActEx = new CPropertyActionEx(this, &Etaluma::OnLatencyPercentile, 99);
+	ret = CreateProperty(g_LatencyP99, "0", MM::Float, true, pActEx);
+	assert(ret == DEVICE_OK);
+
+	// LED SEQUENCE
+	// A comma separated list of "ledId:brightness" pairs, one per frame. When
+	// set, the acquisition thread cycles through the list during sequence
+	// acquisitions, switching LEDs at frame boundaries.
+	pAct = new CPropertyAction(this, &Etaluma::OnLedSequence);
+	ret = CreateProperty(g_LedSequence, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	// Frame periods the LED is given to settle after a switch. Only frames
+	// that started exposing after that are delivered; 0 still drops the
+	// frames that straddled the switch or were queued before it.
+	pAct = new CPropertyAction(this, &Etaluma::OnLedSettleFrames);
+	ret = CreateProperty(g_LedSettleFrames, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_LedSettleFrames, 0, 4);
+
+	// PREVIEW AND RECORDING
+	// With a recording file set, every full resolution frame of a sequence is
+	// written to disk by a separate thread. The images a sequence hands to
+	// the core can be downsampled and rate limited independently, so live
+	// view stays cheap. Snaps are never downsampled.
+	pAct = new CPropertyAction(this, &Etaluma::OnPreviewDecimation);
+	ret = CreateProperty(g_PreviewDecimation, "1", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> decimationValues;
+	decimationValues.push_back("1");
+	decimationValues.push_back("2");
+	decimationValues.push_back("4");
+	ret = SetAllowedValues(g_PreviewDecimation, decimationValues);
+	assert(ret == DEVICE_OK);
+
+	// Zero delivers every frame.
+	pAct = new CPropertyAction(this, &Etaluma::OnPreviewMaxFps);
+	ret = CreateProperty(g_PreviewMaxFps, "0", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_PreviewMaxFps, 0, 200);
+
+	// Empty disables recording.
+	pAct = new CPropertyAction(this, &Etaluma::OnRecordingFile);
+	ret = CreateProperty(g_RecordingFile, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	// TIME-LAPSE SCHEDULING
+	// Sequences with an interval take the first frame that starts after each
+	// deadline. When the interval is long enough the ISO stream is stopped
+	// in between, freeing the bus, and restarted this long before the next
+	// deadline.
+	pAct = new CPropertyAction(this, &Etaluma::OnIntervalPreWarm);
+	ret = CreateProperty(g_IntervalPreWarm, "250", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_IntervalPreWarm, 0, 5000);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnIdleBetweenFrames);
+	ret = CreateProperty(g_IdleBetweenFrames, g_On, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	ret = SetAllowedValues(g_IdleBetweenFrames, offOnValues);
+	assert(ret == DEVICE_OK);
+
+	// Spread and worst case of the scheduling error over the last sequence.
+	pAct = new CPropertyAction(this, &Etaluma::OnScheduleJitter);
+	ret = CreateProperty(g_ScheduleJitter, "0", MM::Float, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnScheduleErrorMax);
+	ret = CreateProperty(g_ScheduleErrorMax, "0", MM::Float, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	// DEFECT PIXEL CORRECTION
+	// Capture a dark frame (no light) and a flat frame (even illumination)
+	// through the Defect Map Capture property. The map is saved to the Defect
+	// Map File and loaded again at the next Initialize.
+	char defectMapFile[MM::MaxStrLength];
+	GetProperty(g_DefectMapFile, defectMapFile);
+	defectMapFile_ = defectMapFile;
+	defects_.SetSensorSize(IMAGE_WIDTH, IMAGE_HEIGHT);
+	defects_.Load(defectMapFile_);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnDefectCorrection);
+	ret = CreateProperty(g_DefectCorrection, defects_.Count() > 0 ? g_On : g_Off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	ret = SetAllowedValues(g_DefectCorrection, offOnValues);
+	assert(ret == DEVICE_OK);
+	defectCorrection_ = defects_.Count() > 0;
+
+	pAct = new CPropertyAction(this, &Etaluma::OnDefectMapCapture);
+	ret = CreateProperty(g_DefectMapCapture, g_DefectMapCapture_Idle, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> defectCaptureValues;
+	defectCaptureValues.push_back(g_DefectMapCapture_Idle);
+	defectCaptureValues.push_back(g_DefectMapCapture_Dark);
+	defectCaptureValues.push_back(g_DefectMapCapture_Flat);
+	defectCaptureValues.push_back(g_DefectMapCapture_Clear);
+	ret = SetAllowedValues(g_DefectMapCapture, defectCaptureValues);
+	assert(ret == DEVICE_OK);
+
+	// Grey levels a pixel of the dark frame must exceed its neighbours by
+	// to count as hot.
+	pAct = new CPropertyAction(this, &Etaluma::OnDefectThreshold);
+	ret = CreateProperty(g_DefectThreshold, "32", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_DefectThreshold, 1, 255);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnDefectCount);
+	ret = CreateProperty(g_DefectCount, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	// BINNING
+	// Done in software by the conversion kernel, as the mean of each block.
+	pAct = new CPropertyAction(this, &Etaluma::OnBinning);
+	ret = CreateProperty(MM::g_Keyword_Binning, "1", MM::Integer, false, pAct);
 	assert(ret == DEVICE_OK);
 
 	vector<string> binningValues;
 	binningValues.push_back("1");
 	binningValues.push_back("2");
+	binningValues.push_back("4");
 
 	ret = SetAllowedValues(MM::g_Keyword_Binning, binningValues);
-	assert(ret == DEVICE_OK);*/
+	assert(ret == DEVICE_OK);
+
+	// MONO CONVERSION
+	// How the color frames from LumaUSB are turned into intensity.
+	pAct = new CPropertyAction(this, &Etaluma::OnMonoConversion);
+	ret = CreateProperty(g_MonoConversion, g_MonoConversion_Luminance, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> monoValues;
+	monoValues.push_back(g_MonoConversion_Luminance);
+	monoValues.push_back(g_MonoConversion_Green);
+	ret = SetAllowedValues(g_MonoConversion, monoValues);
+	assert(ret == DEVICE_OK);
+
+	// FRAME STATISTICS
+	// Per-channel histograms, min, max, mean and saturated pixel counts,
+	// computed while converting and added to the metadata of every image.
+	pAct = new CPropertyAction(this, &Etaluma::OnFrameStatistics);
+	ret = CreateProperty(g_FrameStatistics, g_Off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	ret = SetAllowedValues(g_FrameStatistics, offOnValues);
+	assert(ret == DEVICE_OK);
+
+	// MULTIPLE ROIS
+	// "x,y,w,h;x,y,w,h;..." in binned pixels. Each frame is converted only
+	// inside these regions. Packed output delivers one image with the
+	// regions side by side, tagged output one image per region, padded to
+	// the largest region and labelled with its index. A snap in tagged mode
+	// returns the first region. Recordings always hold the packed image.
+	pAct = new CPropertyAction(this, &Etaluma::OnRoiList);
+	ret = CreateProperty(g_RoiList, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnRoiOutput);
+	ret = CreateProperty(g_RoiOutput, g_RoiOutput_Packed, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> roiOutputValues;
+	roiOutputValues.push_back(g_RoiOutput_Packed);
+	roiOutputValues.push_back(g_RoiOutput_Tagged);
+	ret = SetAllowedValues(g_RoiOutput, roiOutputValues);
+	assert(ret == DEVICE_OK);
+
+	// SHARED MEMORY RING
+	// Name of a shared memory ring that local processes can map to get the
+	// frames of a sequence as they arrive, see SharedFrameReader.h. Empty
+	// turns it off.
+	pAct = new CPropertyAction(this, &Etaluma::OnSharedMemoryRing);
+	ret = CreateProperty(g_SharedMemoryRing, "", MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnSharedMemorySlots);
+	ret = CreateProperty(g_SharedMemorySlots, "8", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_SharedMemorySlots, 2, 64);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnSharedMemoryFrames);
+	ret = CreateProperty(g_SharedMemoryFrames, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnSharedMemoryThroughput);
+	ret = CreateProperty(g_SharedMemoryThroughput, "0", MM::Float, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	// STRIP DELIVERY
+	// Rows per band handed to registered StripConsumers while a frame is
+	// converted, 0 for none. Strips are the converted frame before
+	// averaging, and are not delivered with a ROI List.
+	pAct = new CPropertyAction(this, &Etaluma::OnStripRows);
+	ret = CreateProperty(g_StripRows, "0", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	vector<string> stripValues;
+	stripValues.push_back("0");
+	stripValues.push_back("16");
+	stripValues.push_back("32");
+	stripValues.push_back("64");
+	stripValues.push_back("128");
+	stripValues.push_back("256");
+	ret = SetAllowedValues(g_StripRows, stripValues);
+	assert(ret == DEVICE_OK);
+
+	// CHANGE-TRIGGERED CAPTURE
+	// Only deliver sequence frames that differ from the last delivered one,
+	// with a few frames of context on either side. The score is the mean
+	// absolute difference, in 8 bit grey levels, of the most changed 64 x 64
+	// tile, over every Change Row Step-th row. Frames held back still count
+	// towards the sequence length.
+	pAct = new CPropertyAction(this, &Etaluma::OnChangeTrigger);
+	ret = CreateProperty(g_ChangeTrigger, g_Off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	ret = SetAllowedValues(g_ChangeTrigger, offOnValues);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnChangeThreshold);
+	ret = CreateProperty(g_ChangeThreshold, "4", MM::Float, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_ChangeThreshold, 0, 255);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnChangeRowStep);
+	ret = CreateProperty(g_ChangeRowStep, "4", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_ChangeRowStep, 1, 16);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnPreTriggerFrames);
+	ret = CreateProperty(g_PreTriggerFrames, "4", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_PreTriggerFrames, 0, 32);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnPostTriggerFrames);
+	ret = CreateProperty(g_PostTriggerFrames, "4", MM::Integer, false, pAct);
+	assert(ret == DEVICE_OK);
+	SetPropertyLimits(g_PostTriggerFrames, 0, 1000);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnChangeScore);
+	ret = CreateProperty(g_ChangeScore, "0", MM::Float, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnChangeFramesSkipped);
+	ret = CreateProperty(g_ChangeFramesSkipped, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	// PIPELINE TRACE
+	// Begin and end events of every frame through the transport and
+	// acquisition threads, written to Trace File as Chrome trace events for
+	// chrome://tracing or ui.perfetto.dev. Can be switched on mid-sequence.
+	pAct = new CPropertyAction(this, &Etaluma::OnTraceFile);
+	ret = CreateProperty(g_TraceFile, traceFile_.c_str(), MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnTrace);
+	ret = CreateProperty(g_Trace, g_Off, MM::String, false, pAct);
+	assert(ret == DEVICE_OK);
+	ret = SetAllowedValues(g_Trace, offOnValues);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnTraceEventsWritten);
+	ret = CreateProperty(g_TraceEventsWritten, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
+
+	pAct = new CPropertyAction(this, &Etaluma::OnTraceEventsLost);
+	ret = CreateProperty(g_TraceEventsLost, "0", MM::Integer, true, pAct);
+	assert(ret == DEVICE_OK);
 
 	// PIXEL CLOCK FREQUENCY
 
@@ -228,7 +970,7 @@ int Etaluma::Initialize()
 	//-------------------------------------------//
 	// Synchronize all properties NJS 2015-11-17 //
 	//-------------------------------------------//
-	int ret = UpdateStatus();
+	ret = UpdateStatus();
 	if (ret != DEVICE_OK)
 		return ret;
 
@@ -244,6 +986,12 @@ int Etaluma::Initialize()
 }
 
 int Etaluma::Shutdown() {
+	StopSequenceAcquisition();
+	StopStream();
+	capture_.Close();
+	replay_.Close();
+	sharedRing_.Close();
+	trace_.Close();
 	initialized_ = false;
 	return DEVICE_OK;
 }
@@ -260,82 +1008,121 @@ int Etaluma::SnapImage()
 		return DEVICE_CAMERA_BUSY_ACQUIRING;
 
 	busy_ = true;
-	
-	if (true)
-	{
-
+	previewOutput_ = false;
+
+	// Only frames whose exposure started after the stream is back at the
+	// selected clock are acceptable.
+	int ret = StartStream();
+	double snapStartUs = FrameQueue::Now();
+	if (ret == DEVICE_OK) {
+		PrepareAccumulator();
+		PrepareDefectCorrection();
+		bool ready = WaitForFrameStartedAfter(snapStartUs, exposureMs_ + g_FrameTimeoutMs);
+		while (ready && !ProcessFrame())
+			ready = WaitForFrame(g_FrameTimeoutMs);
+
+		if (!ready)
+			ret = FrameError();
+
+		if (ready && roiTagged_ && !rois_.Empty())
+			rois_.ExtractTile(img_.GetPixels(), img_.Depth(), 0, const_cast<unsigned char*>(roiTile_.GetPixels()));
+
+		ReleaseStream();
 	}
 
-	GenerateImage();
-	return DEVICE_OK;
+	busy_ = false;
+	return ret;
 }
 
 
 const unsigned char* Etaluma::GetImageBuffer()
 {
-	return const_cast<unsigned char*>(img_.GetPixels());
+	return const_cast<unsigned char*>(OutputBuffer().GetPixels());
 }
 
 unsigned Etaluma::GetImageWidth() const
 {
-	return img_.Width();
+	return OutputBuffer().Width();
 }
 
 unsigned Etaluma::GetImageHeight() const
 {
-	return img_.Height();
+	return OutputBuffer().Height();
 }
 
 unsigned Etaluma::GetImageBytesPerPixel() const
 {
-	return img_.Depth();
+	return OutputBuffer().Depth();
 }
 
 unsigned Etaluma::GetBitDepth() const
 {
-	return img_.Depth() == 1 ? 8 : MAX_BIT_DEPTH;
+	if (OutputBuffer().Depth() == 1)
+		return 8;
+
+	// Summed frames grow by one bit per doubling of the frame count.
+	unsigned bits = 8;
+	while (bits < 16 && (1L << (bits - 8)) < framesToAverage_)
+		bits++;
+	return bits;
 }
 
 long Etaluma::GetImageBufferSize() const
 {
-	return img_.Width() * img_.Height() * GetImageBytesPerPixel();
+	return GetImageWidth() * GetImageHeight() * GetImageBytesPerPixel();
 }
 
 int Etaluma::SetROI(unsigned x, unsigned y, unsigned xSize, unsigned ySize)
 {
+	if (IsCapturing())
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+	// The ROI List takes the place of the ROI until it is emptied.
+	if (!rois_.Empty() && (xSize != 0 || ySize != 0))
+		return ERR_ROI_LIST_ACTIVE;
+
 	if (xSize == 0 && ySize == 0)
 	{
 		// effectively clear ROI
-		ResizeImageBuffer();
 		roiX_ = 0;
 		roiY_ = 0;
+		ResizeImageBuffer();
 	}
 	else
 	{
+		// The ROI is in binned pixels and has to lie on the sensor.
+		if (x + xSize > (unsigned)(IMAGE_WIDTH / binning_) || y + ySize > (unsigned)(IMAGE_HEIGHT / binning_))
+			return DEVICE_INVALID_INPUT_PARAM;
+
 		// apply ROI
 		img_.Resize(xSize, ySize);
+		ResizePreviewBuffer();
 		roiX_ = x;
 		roiY_ = y;
+		UpdateKernel();
 	}
 	return DEVICE_OK;
 }
 
 int Etaluma::GetROI(unsigned& x, unsigned& y, unsigned& xSize, unsigned& ySize)
 {
-	x = roiX_;
-	y = roiY_;
+	// In pixels of the image the core gets, which is decimated during
+	// sequences with Preview Decimation.
+	unsigned scale = previewOutput_ ? (unsigned)previewDecimation_ : 1;
+	x = roiX_ / scale;
+	y = roiY_ / scale;
 
-	xSize = img_.Width();
-	ySize = img_.Height();
+	xSize = GetImageWidth();
+	ySize = GetImageHeight();
 
 	return DEVICE_OK;
 }
 
 int Etaluma::ClearROI()
 {
-	ResizeImageBuffer();
 	roiX_ = 0;
 	roiY_ = 0;
+	ResizeImageBuffer();
 
 	return DEVICE_OK;
 }
@@ -347,7 +1134,7 @@ double Etaluma::GetExposure() const
 
 void Etaluma::SetExposure(double exp)
 {
-	exposureMs_ = exp;
+	SetProperty(MM::g_Keyword_Exposure, CDeviceUtils::ConvertToString(exp));
 }
 
 int Etaluma::GetBinning() const
@@ -396,34 +1183,454 @@ int Etaluma::StartSequenceAcquisition(long numImages, double interval_ms, bool s
 	if (ret != DEVICE_OK)
 		return ret;
 
+	ret = StartStream();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	PrepareAccumulator();
+	PrepareDefectCorrection();
+	PrepareChangeTrigger();
+	stopOnOverflow_ = stopOnOverflow;
+	latency_.Reset();
+	currentLedStep_ = -1;
+	lastPreviewUs_ = 0;
+	sequenceStartUs_ = FrameQueue::Now();
+	scheduled_ = interval_ms > 0;
+	scheduleCount_ = 0;
+	scheduleMeanMs_ = 0;
+	scheduleM2_ = 0;
+	scheduleMaxMs_ = 0;
+
+	ret = OpenSharedRing();
+	if (ret != DEVICE_OK) {
+		ReleaseStream();
+		return ret;
+	}
+
+	if (!recordingFile_.empty() &&
+		!recorder_.Open(recordingFile_, img_.Width(), img_.Height(), img_.Depth(), frameQueueLength_)) {
+		ReleaseStream();
+		return ERR_RECORDING_FAILED;
+	}
+
+	// The core sized its buffer from GetImageWidth before calling in here,
+	// which describes snaps, so resize it for the decimated images.
+	previewOutput_ = previewDecimation_ > 1;
+	if (previewOutput_) {
+		ret = GetCoreCallback()->InitializeImageBuffer(1, 1, GetImageWidth(), GetImageHeight(), GetImageBytesPerPixel());
+		if (ret != DEVICE_OK) {
+			previewOutput_ = false;
+			recorder_.Close();
+			ReleaseStream();
+			return ret;
+		}
+	}
+
+	thd_->Start(numImages, interval_ms);
+
+	return DEVICE_OK;
+}
+
+/********************************************************************************
+* Acquire one frame of a sequence. Called from the acquisition thread.			*
+*																				*
+* With an interval set, the frame is the first one that started exposing		*
+* after its deadline. Long intervals run with the stream stopped until			*
+* preWarmMs_ before the deadline.												*
+*																				*
+* If an LED sequence is defined, the LED for this frame is switched on first	*
+* and the frames whose exposure straddled the switch are discarded, so every	*
+* delivered frame was exposed under a single illumination channel.				*
+********************************************************************************/
+int Etaluma::AcquireSequenceFrame(long frameIndex)
+{
+	double intervalMs = thd_->GetIntervalMs();
+	double deadlineUs = sequenceStartUs_ + frameIndex * intervalMs * 1000.0;
+	bool idle = scheduled_ && IdleBetweenFrames(intervalMs);
+
+	ApplyPendingSettings();
+
+	if (scheduled_) {
+		// Sleep through the interval rather than converting frames, leaving
+		// enough lead to restart the stream or catch the next frame.
+		double leadMs = idle ? preWarmMs_ : 2 * max(framePeriodMs_, exposureMs_);
+		if (!SleepUntil(deadlineUs - leadMs * 1000.0, !idle))
+			return DEVICE_OK;
+
+		if (idle) {
+			int ret = StartStream();
+			if (ret != DEVICE_OK)
+				return ret;
+		}
+	}
+
+	// Frames that started exposing before this are not delivered.
+	double startUs = scheduled_ ? deadlineUs : 0;
+
+	if (!ledSequence_.empty()) {
+		int step = (int)(frameIndex % (long)ledSequence_.size());
+		const LedStep& ledStep = ledSequence_[step];
+		bool switched = (activeLedId_ != ledStep.ledId) || (currentLedStep_ < 0) ||
+			(ledSequence_[currentLedStep_].brightness != ledStep.brightness);
+
+		int ret = ApplyLedStep(ledStep);
+		if (ret != DEVICE_OK)
+			return ret;
+		currentLedStep_ = step;
+
+		// The frames waiting in the queue, and the one being read out, were
+		// exposed under the previous step. Counting frames is not enough to
+		// skip them, so go by when the frames started instead.
+		if (switched)
+			startUs = max(startUs, FrameQueue::Now() + ledSettleFrames_ * framePeriodMs_ * 1000.0);
+	}
+
+	bool ready = (startUs > 0) ?
+		WaitForFrameStartedAfter(startUs, max(startUs - FrameQueue::Now(), 0.0) / 1000.0 + exposureMs_ + g_FrameTimeoutMs) :
+		WaitForFrame(g_FrameTimeoutMs);
+	if (!ready)
+		return FrameError();
+	if (scheduled_) {
+		scheduleErrorMs_ = (frame_.timestampUs - deadlineUs) / 1000.0;
+		AddScheduleError(scheduleErrorMs_);
+	}
+
+	// With averaging enabled several frames go into one delivered image.
+	while (!ProcessFrame()) {
+		if (!WaitForFrame(g_FrameTimeoutMs))
+			return FrameError();
+		if (thd_->IsStopped())
+			return DEVICE_OK;
+	}
+
+	imageTag_.frameNumber = frame_.frameNumber;
+	imageTag_.imageNumber = frameIndex;
+	imageTag_.timestampUs = frame_.timestampUs;
+	imageTag_.ledStep = currentLedStep_;
+	imageTag_.scheduleErrorMs = scheduleErrorMs_;
+	imageTag_.trigger = TRIGGER_NONE;
+	imageTag_.changeScore = 0;
+
+	// A frame that started before the last settings change was exposed
+	// under the previous generation.
+	imageTag_.settingsGeneration = (frame_.timestampUs - framePeriodMs_ * 1000.0 >= settingsAppliedUs_) ?
+		settingsGeneration_ : previousSettingsGeneration_;
+
+	int ret = changeTrigger_ ? DeliverOnChange() : DeliverImage();
+
+	// Free the bus, and keep the sample dark, until the next deadline.
+	if (idle) {
+		StopStream();
+		if (!ledSequence_.empty() && activeLedId_ >= 0) {
+			DeviceWrite(StreamFile::RECORD_LED, (unsigned char)activeLedId_, 0);
+			activeLedId_ = -1;
+		}
+	}
+
+	return ret;
+}
+
+// Hand the image in img_, described by imageTag_, to the recorder, the shared
+// memory ring and the core. Unless always is set, the core only gets it if
+// a preview is due.
+int Etaluma::DeliverImage(bool always)
+{
+	const LedStep* led = (imageTag_.ledStep >= 0) ? &ledSequence_[imageTag_.ledStep] : 0;
+
+	if (recorder_.IsOpen()) {
+		TraceScope scope(trace_, TraceLog::THREAD_ACQUISITION, "Record", imageTag_.frameNumber);
+		if (!recorder_.Record(img_.GetPixels(), imageTag_.frameNumber, imageTag_.timestampUs, led ? led->ledId : -1))
+			return ERR_RECORDING_FAILED;
+	}
+
+	if (sharedRing_.IsOpen()) {
+		TraceScope scope(trace_, TraceLog::THREAD_ACQUISITION, "Shared Ring", imageTag_.frameNumber);
+		SharedFrameRing::FrameInfo info;
+		info.frameNumber = imageTag_.frameNumber;
+		info.imageNumber = (uint64_t)imageTag_.imageNumber;
+		info.timestampUs = imageTag_.timestampUs;
+		info.ledChannel = led ? led->ledId : -1;
+		info.ledBrightness = led ? led->brightness : 0;
+		sharedRing_.Publish(img_.GetPixels(), img_.Width(), img_.Height(), img_.Depth(), info);
+	}
+
+	// Frames over the preview rate still count towards the sequence length,
+	// they just are not shown.
+	if (!always && !PreviewDue())
+		return DEVICE_OK;
+
+	TraceScope scope(trace_, TraceLog::THREAD_ACQUISITION, "InsertImage", imageTag_.frameNumber);
+	UpdatePreview();
+	return (roiTagged_ && !rois_.Empty()) ? InsertRoiImages() : InsertImage();
+}
+
+/**
+* Change-triggered delivery of the image in img_. The first frame of a
+* sequence is always delivered. Later ones are scored against the last
+* delivered frame; quiet ones are delivered while post-trigger frames are
+* owed and held back otherwise. A trigger delivers the held back frames,
+* oldest first, then itself, and restarts the post-trigger count. They all
+* reach the core, whatever the preview rate, as they were kept for it.
+*/
+int Etaluma::DeliverOnChange()
+{
+	bool first = !changeDetector_.HasReference();
+	if (!first) {
+		TraceScope scope(trace_, TraceLog::THREAD_ACQUISITION, "Change Score", imageTag_.frameNumber);
+		// Sums are compared in grey levels of a single frame.
+		double scale = (img_.Depth() == 2) ? (double)framesToAverage_ : 1.0;
+		changeScore_ = changeDetector_.Score(img_.GetPixels()) / scale;
+	}
+	imageTag_.changeScore = changeScore_;
+
+	if (!first && changeScore_ < changeThreshold_) {
+		if (postTriggerLeft_ == 0) {
+			imageTag_.trigger = TRIGGER_PRE;
+			StorePreTriggerFrame((size_t)preTriggerFrames_);
+			return DEVICE_OK;
+		}
+		postTriggerLeft_--;
+		imageTag_.trigger = TRIGGER_POST;
+	}
+	else {
+		imageTag_.trigger = TRIGGER_FRAME;
+		postTriggerLeft_ = postTriggerFrames_;
+	}
+	changeDetector_.SetReference(img_.GetPixels());
+
+	if (preTriggerCount_ == 0)
+		return DeliverImage();
+
+	// Queue this frame behind the held back ones, then deliver them all
+	// through img_.
+	StorePreTriggerFrame(preTrigger_.size());
+	int ret = DEVICE_OK;
+	while (preTriggerCount_ > 0 && ret == DEVICE_OK) {
+		PreTriggerFrame& held = preTrigger_[preTriggerStart_];
+		memcpy(const_cast<unsigned char*>(img_.GetPixels()), &held.pixels[0], held.pixels.size());
+		imageTag_ = held.tag;
+		stats_ = held.stats;
+		preTriggerStart_ = (preTriggerStart_ + 1) % preTrigger_.size();
+		preTriggerCount_--;
+		ret = DeliverImage(true);
+	}
+	return ret;
+}
+
+// Size the detector and the pre-trigger ring for the coming sequence. The
+// ring has a spare entry for the frame that triggers.
+void Etaluma::PrepareChangeTrigger()
+{
+	postTriggerLeft_ = 0;
+	preTriggerStart_ = 0;
+	preTriggerCount_ = 0;
+	changeScore_ = 0;
+	changeSkipped_ = 0;
+	if (!changeTrigger_)
+		return;
+
+	changeDetector_.Configure(img_.Width(), img_.Height(), img_.Depth(), (unsigned)changeRowStep_);
+	size_t bytes = (size_t)img_.Width() * img_.Height() * img_.Depth();
+	preTrigger_.resize(preTriggerFrames_ > 0 ? preTriggerFrames_ + 1 : 0);
+	for (size_t i = 0; i < preTrigger_.size(); i++)
+		preTrigger_[i].pixels.resize(bytes);
+}
+
+// Append the image in img_ to the pre-trigger ring, dropping the oldest
+// entry once limit are held.
+void Etaluma::StorePreTriggerFrame(size_t limit)
+{
+	if (limit == 0 || preTrigger_.empty()) {
+		changeSkipped_++;
+		return;
+	}
+
+	if (preTriggerCount_ >= limit) {
+		preTriggerStart_ = (preTriggerStart_ + 1) % preTrigger_.size();
+		preTriggerCount_--;
+		changeSkipped_++;
+	}
+
+	PreTriggerFrame& held = preTrigger_[(preTriggerStart_ + preTriggerCount_) % preTrigger_.size()];
+	memcpy(&held.pixels[0], img_.GetPixels(), held.pixels.size());
+	held.tag = imageTag_;
+	held.stats = stats_;
+	preTriggerCount_++;
+}
+
+// Switch the illumination to the given LED, turning off the previously active
+// LED if it is a different one.
+int Etaluma::ApplyLedStep(const LedStep& step)
+{
+	if (activeLedId_ >= 0 && activeLedId_ != step.ledId) {
+		if (!DeviceWrite(StreamFile::RECORD_LED, (unsigned char)activeLedId_, 0))
+			return ERR_LED_WRITE_FAILED;
+	}
+
+	if (!DeviceWrite(StreamFile::RECORD_LED, step.ledId, step.brightness))
+		return ERR_LED_WRITE_FAILED;
+
+	activeLedId_ = step.ledId;
 	return DEVICE_OK;
 }
 
-int Etaluma::InsertImage()
+// Called by the acquisition thread just before it exits.
+void Etaluma::OnThreadExiting() throw()
 {
+	try
+	{
+		ReleaseStream();
+
+		// Leave the sample in the dark once an illumination sequence ends.
+		if (!ledSequence_.empty() && activeLedId_ >= 0) {
+			DeviceWrite(StreamFile::RECORD_LED, (unsigned char)activeLedId_, 0);
+			activeLedId_ = -1;
+		}
+		currentLedStep_ = -1;
+
+		// Changes posted while the sequence wound down.
+		ApplyPendingSettings();
+
+		if (recorder_.IsOpen()) {
+			recorder_.Close();
+			ostringstream os;
+			os << "Recorded " << recorder_.FramesWritten() << " frames to " << recordingFile_;
+			LogMessage(os.str().c_str(), true);
+		}
+
+		LogMessage("Sequence acquisition thread exiting", true);
+		GetCoreCallback() ? GetCoreCallback()->AcqFinished(this, 0) : DEVICE_OK;
+	}
+	catch (...)
+	{
+		LogMessage("Exception in Etaluma::OnThreadExiting", false);
+	}
+}
 
-	MM::MMTime timeStamp = this->GetCurrentMMTime();
+/**
+* Send the output buffer to the core. roiIndex names the region of the ROI
+* List the buffer holds in tagged mode, and is negative otherwise.
+*/
+int Etaluma::InsertImage(int roiIndex)
+{
 	char label[MM::MaxStrLength];
 	this->GetLabel(label);
 
 	// Important:  metadata about the image are generated here:
 	Metadata md;
+	md.put("Camera", label);
+	// From the tag rather than the clock and the thread's counter, since
+	// held back frames are inserted in a burst, long after they arrived.
+	md.put(MM::g_Keyword_Elapsed_Time_ms, CDeviceUtils::ConvertToString((imageTag_.timestampUs - sequenceStartUs_) / 1000.0));
+	md.put(MM::g_Keyword_Metadata_ImageNumber, CDeviceUtils::ConvertToString(imageTag_.imageNumber));
+	if (haveFrame_) {
+		md.put(g_Keyword_UsbFrameNumber, CDeviceUtils::ConvertToString((long)imageTag_.frameNumber));
+		md.put(g_Keyword_SettingsGeneration, CDeviceUtils::ConvertToString((long)imageTag_.settingsGeneration));
+	}
+	md.put(g_FramesDropped, CDeviceUtils::ConvertToString((long)frameQueue_.Dropped()));
+	if (haveFrame_) {
+		// Held back frames are late on purpose, keep them out of the
+		// latency percentiles.
+		double latencyMs = (FrameQueue::Now() - imageTag_.timestampUs) / 1000.0;
+		if (imageTag_.trigger != TRIGGER_PRE)
+			latency_.Add(latencyMs);
+		md.put(g_Keyword_FrameLatency, CDeviceUtils::ConvertToString(latencyMs));
+	}
+	if (imageTag_.ledStep >= 0) {
+		md.put(g_Keyword_LedChannel, CDeviceUtils::ConvertToString((long)ledSequence_[imageTag_.ledStep].ledId));
+		md.put(g_Keyword_LedBrightness, CDeviceUtils::ConvertToString((long)ledSequence_[imageTag_.ledStep].brightness));
+	}
+	if (frameStats_)
+		AddStatistics(md);
+	if (scheduled_)
+		md.put(g_Keyword_ScheduleError, CDeviceUtils::ConvertToString(imageTag_.scheduleErrorMs));
+	if (imageTag_.trigger != TRIGGER_NONE) {
+		md.put(g_Keyword_ChangeTrigger, g_ChangeTriggerLabels[imageTag_.trigger]);
+		md.put(g_ChangeScore, CDeviceUtils::ConvertToString(imageTag_.changeScore));
+	}
+	if (recorder_.IsOpen())
+		md.put(g_Keyword_FramesRecorded, CDeviceUtils::ConvertToString((long)recorder_.FramesWritten()));
+	if (roiIndex >= 0) {
+		const RoiList::Roi& roi = rois_[roiIndex];
+		ostringstream os;
+		os << roi.x << "," << roi.y << "," << roi.width << "," << roi.height;
+		md.put(g_Keyword_RoiIndex, CDeviceUtils::ConvertToString((long)roiIndex));
+		md.put(g_Keyword_Roi, os.str());
+	}
+	else if (!rois_.Empty()) {
+		md.put(g_RoiList, rois_.Format());
+	}
+
+	const unsigned char* pI = GetImageBuffer();
+	unsigned int w = GetImageWidth();
+	unsigned int h = GetImageHeight();
+	unsigned int b = GetImageBytesPerPixel();
+
+	int ret = GetCoreCallback()->InsertImage(this, pI, w, h, b, md.Serialize().c_str());
+	if (ret == DEVICE_BUFFER_OVERFLOW && !stopOnOverflow_) {
+		// do not stop on overflow - just reset the buffer
+		GetCoreCallback()->ClearImageBuffer(this);
+		return GetCoreCallback()->InsertImage(this, pI, w, h, b, md.Serialize().c_str(), false);
+	}
 
+	return ret;
+}
+
+// Send each region of the packed image in img_ to the core as a tile of its
+// own.
+int Etaluma::InsertRoiImages()
+{
+	unsigned char* tile = const_cast<unsigned char*>(roiTile_.GetPixels());
+	for (size_t i = 0; i < rois_.Count(); i++) {
+		rois_.ExtractTile(img_.GetPixels(), img_.Depth(), i, tile);
+		int ret = InsertImage((int)i);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
 	return DEVICE_OK;
 }
 
+/**
+* Add the statistics of the last converted frame to md. The source channels
+* describe that frame. The image channel is left out when frames are
+* averaged or summed, since it would not describe the delivered image.
+*/
+void Etaluma::AddStatistics(Metadata& md) const
+{
+	int channels = accumulator_.IsActive() ? FrameKernel::Stats::CHANNEL_IMAGE : FrameKernel::Stats::CHANNEL_COUNT;
+	for (int c = 0; c < channels; c++) {
+		string prefix = g_StatisticsChannels[c];
+		md.put(prefix + " Min", CDeviceUtils::ConvertToString((long)stats_.Min(c)));
+		md.put(prefix + " Max", CDeviceUtils::ConvertToString((long)stats_.Max(c)));
+		md.put(prefix + " Mean", CDeviceUtils::ConvertToString(stats_.Mean(c)));
+		md.put(prefix + " Saturated", CDeviceUtils::ConvertToString((long)stats_.Saturated(c)));
+
+		ostringstream histogram;
+		for (int i = 0; i < 256; i++)
+			histogram << (i ? "," : "") << stats_.histogram[c][i];
+		md.put(prefix + " Histogram", histogram.str());
+	}
+}
+
 bool Etaluma::IsCapturing() {
 	return !thd_->IsStopped();
 }
 
-// BINNING CALLBACK - not implemented
-/*int Etaluma::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
+// Handler for the Binning property. Changing the binning clears the ROI and
+// the ROI List.
+int Etaluma::OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::AfterSet)
 	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
 		long binSize;
 		pProp->Get(binSize);
 		binning_ = (int)binSize;
+		roiX_ = 0;
+		roiY_ = 0;
+		rois_.Clear();
 		return ResizeImageBuffer();
 	}
 	else if (eAct == MM::BeforeGet)
@@ -432,7 +1639,47 @@ bool Etaluma::IsCapturing() {
 	}
 
 	return DEVICE_OK;
-}*/
+}
+
+int Etaluma::OnFrameStatistics(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string value;
+		pProp->Get(value);
+		frameStats_ = (value == g_On);
+		UpdateKernel();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(frameStats_ ? g_On : g_Off);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnMonoConversion(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string value;
+		pProp->Get(value);
+		monoFormat_ = (value == g_MonoConversion_Green) ? FrameKernel::FORMAT_GREEN : FrameKernel::FORMAT_LUMINANCE;
+		UpdateKernel();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(monoFormat_ == FrameKernel::FORMAT_GREEN ? g_MonoConversion_Green : g_MonoConversion_Luminance);
+	}
+
+	return DEVICE_OK;
+}
 
 // Handler for the Gain property for Etaluma adapter. This method constrains the gain values
 // to the allowable values.
@@ -455,7 +1702,7 @@ int Etaluma::OnGain(MM::PropertyBase* pProp, MM::ActionType eAct)
 			gain_ = gain;
 		}
 
-		if (!lumaUSB.SetGlobalGain(gain)) {
+		if (ChangeSetting(SettingsQueue::SETTING_GLOBAL_GAIN, (unsigned short)gain_) != DEVICE_OK) {
 			return DEVICE_CAN_NOT_SET_PROPERTY;
 		}
 	}
@@ -468,74 +1715,1838 @@ int Etaluma::OnGain(MM::PropertyBase* pProp, MM::ActionType eAct)
 }
 
 // Handler for the Exposure property for Etaluma adapter. This method constrains the exposure values
-// to the allowable values.
+// to the allowable values and sets the shutter width register.
 // NJS 2015-11-17
 
 int Etaluma::OnExposure(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::AfterSet)
 	{
-		double gain;
-		pProp->Get(gain);
+		double exposure;
+		pProp->Get(exposure);
 
-		// Check to see if parameter was set within ranage
-		if (gain > pProp->GetUpperLimit()) {
-			gain_ = pProp->GetUpperLimit();
+		// Check to see if parameter was set within range
+		if (exposure > pProp->GetUpperLimit()) {
+			exposure = pProp->GetUpperLimit();
 		}
-		else if (gain < pProp->GetLowerLimit()) {
-			gain_ = pProp->GetLowerLimit();
+		else if (exposure < pProp->GetLowerLimit()) {
+			exposure = pProp->GetLowerLimit();
 		}
-		else {
-			gain_ = gain;
+
+		int ret = ChangeSetting(SettingsQueue::SETTING_EXPOSURE, ExposureRows(exposure));
+		if (ret != DEVICE_OK)
+			return ret;
+		exposureMs_ = exposure;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(exposureMs_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnPixelClock(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string clock;
+		pProp->Get(clock);
+
+		vector<string>::const_iterator it = find(clockFreqMHz_.begin(), clockFreqMHz_.end(), clock);
+		if (it == clockFreqMHz_.end())
+			return DEVICE_INVALID_PROPERTY_VALUE;
+
+		return SetPixelClock((int)(it - clockFreqMHz_.begin()));
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(currentClockFreqMHz_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnSnapMode(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string mode;
+		pProp->Get(mode);
+		warmStream_ = (mode == g_SnapMode_WarmStream);
+
+		// Leave the stream alone while a sequence owns it, the acquisition
+		// thread stops it on exit if warm streaming was turned off.
+		if (IsCapturing())
+			return DEVICE_OK;
+
+		if (warmStream_) {
+			int ret = StartStream();
+			if (ret != DEVICE_OK)
+				return ret;
 		}
+		ReleaseStream();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(warmStream_ ? g_SnapMode_WarmStream : g_SnapMode_OnDemand);
+	}
 
-		if (!lumaUSB.SetGlobalGain(gain)) {
-			return DEVICE_CAN_NOT_SET_PROPERTY;
+	return DEVICE_OK;
+}
+
+int Etaluma::OnFrameAveraging(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string mode;
+		pProp->Get(mode);
+		if (mode == g_FrameAveraging_Average)
+			averagingMode_ = FrameAccumulator::MODE_AVERAGE;
+		else if (mode == g_FrameAveraging_Sum)
+			averagingMode_ = FrameAccumulator::MODE_SUM;
+		else if (mode == g_FrameAveraging_Running)
+			averagingMode_ = FrameAccumulator::MODE_RUNNING_AVERAGE;
+		else
+			averagingMode_ = FrameAccumulator::MODE_OFF;
+
+		// Sums are delivered as 16 bit images, keep the current ROI size.
+		bytesPerPixel_ = (averagingMode_ == FrameAccumulator::MODE_SUM) ? 2 : 1;
+		img_.Resize(img_.Width(), img_.Height(), bytesPerPixel_);
+		ResizePreviewBuffer();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		switch (averagingMode_)
+		{
+		case FrameAccumulator::MODE_AVERAGE:
+			pProp->Set(g_FrameAveraging_Average);
+			break;
+		case FrameAccumulator::MODE_SUM:
+			pProp->Set(g_FrameAveraging_Sum);
+			break;
+		case FrameAccumulator::MODE_RUNNING_AVERAGE:
+			pProp->Set(g_FrameAveraging_Running);
+			break;
+		default:
+			pProp->Set(g_FrameAveraging_Off);
+			break;
 		}
 	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnFramesToAverage(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(framesToAverage_);
+	}
 	else if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(gain_);
+		pProp->Set(framesToAverage_);
 	}
 
 	return DEVICE_OK;
 }
 
-int Etaluma::OnPixelClock(MM::PropertyBase* pProp, MM::ActionType eAct)
+int Etaluma::OnFrameQueueLength(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
 	if (eAct == MM::AfterSet)
 	{
-		pProp->Get(currentClockFreqMHz_);
+		pProp->Get(frameQueueLength_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(frameQueueLength_);
+	}
 
-		int freqIndex = currentClockFreqMHz_.find(currentClockFreqMHz_);
-		
-		if (!lumaUSB.SetImageSensorPixelClockFrequency(freqIndex)) {
-			return DEVICE_CAN_NOT_SET_PROPERTY;
+	return DEVICE_OK;
+}
+
+int Etaluma::OnOverflowPolicy(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string policy;
+		pProp->Get(policy);
+		if (policy == g_OverflowPolicy_DropNewest)
+			overflowPolicy_ = FrameQueue::OVERFLOW_DROP_NEWEST;
+		else if (policy == g_OverflowPolicy_Block)
+			overflowPolicy_ = FrameQueue::OVERFLOW_BLOCK;
+		else if (policy == g_OverflowPolicy_Stop)
+			overflowPolicy_ = FrameQueue::OVERFLOW_STOP;
+		else
+			overflowPolicy_ = FrameQueue::OVERFLOW_DROP_OLDEST;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		switch (overflowPolicy_)
+		{
+		case FrameQueue::OVERFLOW_DROP_NEWEST:
+			pProp->Set(g_OverflowPolicy_DropNewest);
+			break;
+		case FrameQueue::OVERFLOW_BLOCK:
+			pProp->Set(g_OverflowPolicy_Block);
+			break;
+		case FrameQueue::OVERFLOW_STOP:
+			pProp->Set(g_OverflowPolicy_Stop);
+			break;
+		default:
+			pProp->Set(g_OverflowPolicy_DropOldest);
+			break;
 		}
 	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnFrameQueueOccupancy(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)frameQueue_.Occupancy());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnFramesDropped(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)frameQueue_.Dropped());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnThreadCpu(MM::PropertyBase* pProp, MM::ActionType eAct, long thread)
+{
+	long& cpu = (thread == g_TransportThread) ? transportCpu_ : processingCpu_;
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(cpu);
+	}
 	else if (eAct == MM::BeforeGet)
 	{
-		pProp->Set(currentClockFreqMHz_.c_str());
+		pProp->Set(cpu);
 	}
 
 	return DEVICE_OK;
 }
 
-int Etaluma::ResizeImageBuffer()
+int Etaluma::OnThreadPriority(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string priority;
+		pProp->Get(priority);
+		if (priority == g_ThreadPriority_AboveNormal)
+			threadPriority_ = ThreadScheduling::PRIORITY_ABOVE_NORMAL;
+		else if (priority == g_ThreadPriority_Highest)
+			threadPriority_ = ThreadScheduling::PRIORITY_HIGHEST;
+		else if (priority == g_ThreadPriority_TimeCritical)
+			threadPriority_ = ThreadScheduling::PRIORITY_TIME_CRITICAL;
+		else
+			threadPriority_ = ThreadScheduling::PRIORITY_NORMAL;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		switch (threadPriority_)
+		{
+		case ThreadScheduling::PRIORITY_ABOVE_NORMAL:
+			pProp->Set(g_ThreadPriority_AboveNormal);
+			break;
+		case ThreadScheduling::PRIORITY_HIGHEST:
+			pProp->Set(g_ThreadPriority_Highest);
+			break;
+		case ThreadScheduling::PRIORITY_TIME_CRITICAL:
+			pProp->Set(g_ThreadPriority_TimeCritical);
+			break;
+		default:
+			pProp->Set(g_ThreadPriority_Normal);
+			break;
+		}
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnNumaLocalPool(MM::PropertyBase* pProp, MM::ActionType eAct)
 {
-	img_.Resize(IMAGE_WIDTH / binning_, IMAGE_HEIGHT / binning_, bytesPerPixel_);
+	if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		numaLocalPool_ = (value == g_On);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(numaLocalPool_ ? g_On : g_Off);
+	}
 
 	return DEVICE_OK;
 }
 
-/**
-* Generate an image with fixed value for all pixels
-*/
-void Etaluma::GenerateImage()
+int Etaluma::OnLatencyPercentile(MM::PropertyBase* pProp, MM::ActionType eAct, long percentile)
 {
-	const int maxValue = (1 << MAX_BIT_DEPTH) - 1; // max for the 8 bit camera
-	const double maxExp = MAX_IMAGE_SENSOR_EXPOSURE;
-	double step = maxValue / maxExp;
-	unsigned char* pBuf = const_cast<unsigned char*>(img_.GetPixels());
-	memset(pBuf, (int)(step * max(exposureMs_, maxExp)), img_.Height()*img_.Width()*img_.Depth());
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(latency_.Percentile((double)percentile));
+	}
+
+	return DEVICE_OK;
+}
+
+// Handler for the LED Sequence property. The sequence is parsed once here so
+// that the acquisition thread only has to index into it.
+int Etaluma::OnLedSequence(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string text;
+		pProp->Get(text);
+
+		vector<LedStep> sequence;
+		istringstream entries(text);
+		string entry;
+		while (getline(entries, entry, ',')) {
+			if (entry.find_first_not_of(" \t") == string::npos)
+				continue;
+
+			int ledId, brightness;
+			char sep;
+			istringstream fields(entry);
+			if (!(fields >> ledId >> sep >> brightness) || sep != ':' ||
+				ledId < 0 || ledId > 255 || brightness < 0 || brightness > 255) {
+				return ERR_INVALID_LED_SEQUENCE;
+			}
+
+			LedStep step;
+			step.ledId = (unsigned char)ledId;
+			step.brightness = (unsigned char)brightness;
+			sequence.push_back(step);
+		}
+
+		ledSequence_ = sequence;
+		ledSequenceText_ = text;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(ledSequenceText_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnLedSettleFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(ledSettleFrames_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(ledSettleFrames_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnPreviewDecimation(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(previewDecimation_);
+		previewOutput_ = false;
+		ResizePreviewBuffer();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(previewDecimation_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnPreviewMaxFps(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(previewMaxFps_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(previewMaxFps_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnRecordingFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(recordingFile_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(recordingFile_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnCalibratePixelClock(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		if (value == g_CalibratePixelClock_Run)
+			return CalibratePixelClock();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_CalibratePixelClock_Idle);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnCalibrationResult(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(calibrationResult_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnDefectCorrection(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string value;
+		pProp->Get(value);
+		defectCorrection_ = (value == g_On);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(defectCorrection_ ? g_On : g_Off);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnDefectMapCapture(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		if (value == g_DefectMapCapture_Idle)
+			return DEVICE_OK;
+
+		if (IsCapturing() || busy_)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		if (value == g_DefectMapCapture_Clear) {
+			defects_.Clear();
+		}
+		else {
+			busy_ = true;
+			vector<unsigned char> frame;
+			int ret = CaptureSensorFrame(frame);
+			busy_ = false;
+			if (ret != DEVICE_OK)
+				return ret;
+
+			if (value == g_DefectMapCapture_Dark)
+				defects_.DetectDark(&frame[0], (unsigned)defectThreshold_);
+			else
+				defects_.DetectFlat(&frame[0]);
+		}
+
+		ostringstream os;
+		os << "Defect map holds " << defects_.Count() << " pixels";
+		LogMessage(os.str().c_str(), false);
+		if (!defects_.Save(defectMapFile_))
+			return ERR_DEFECT_MAP_FILE;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(g_DefectMapCapture_Idle);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnDefectThreshold(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(defectThreshold_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(defectThreshold_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnDefectCount(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)defects_.Count());
+	}
+
+	return DEVICE_OK;
+}
+
+// Handler for the ROI List property. The list is checked against the sensor
+// at the current binning and replaces the ROI.
+int Etaluma::OnRoiList(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string text;
+		pProp->Get(text);
+		if (!rois_.Parse(text, IMAGE_WIDTH / binning_, IMAGE_HEIGHT / binning_))
+			return DEVICE_INVALID_PROPERTY_VALUE;
+		roiX_ = 0;
+		roiY_ = 0;
+		return ResizeImageBuffer();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(rois_.Format().c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnRoiOutput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string value;
+		pProp->Get(value);
+		roiTagged_ = (value == g_RoiOutput_Tagged);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(roiTagged_ ? g_RoiOutput_Tagged : g_RoiOutput_Packed);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnSharedMemoryRing(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(sharedRingName_);
+		if (sharedRingName_.empty())
+			sharedRing_.Close();
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sharedRingName_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnSharedMemorySlots(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(sharedRingSlots_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sharedRingSlots_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnSharedMemoryFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)sharedRing_.Published());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnSharedMemoryThroughput(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(sharedRing_.ThroughputMBps());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnStripRows(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(stripRows_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(stripRows_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnChangeTrigger(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string value;
+		pProp->Get(value);
+		changeTrigger_ = (value == g_On);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(changeTrigger_ ? g_On : g_Off);
+	}
+
+	return DEVICE_OK;
+}
+
+// The threshold may be tuned while a sequence runs.
+int Etaluma::OnChangeThreshold(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(changeThreshold_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(changeThreshold_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnChangeRowStep(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(changeRowStep_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(changeRowStep_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnPreTriggerFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(preTriggerFrames_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(preTriggerFrames_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnPostTriggerFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		pProp->Get(postTriggerFrames_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(postTriggerFrames_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnChangeScore(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(changeScore_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnChangeFramesSkipped(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)changeSkipped_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnTrace(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string value;
+		pProp->Get(value);
+		if (value != g_On) {
+			trace_.Close();
+		}
+		else if (!trace_.IsOpen() && !trace_.Open(traceFile_)) {
+			pProp->Set(g_Off);
+			return ERR_TRACE_FILE;
+		}
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(trace_.IsOpen() ? g_On : g_Off);
+	}
+
+	return DEVICE_OK;
+}
+
+// A running trace moves to the new file.
+int Etaluma::OnTraceFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string file;
+		pProp->Get(file);
+		if (file == traceFile_)
+			return DEVICE_OK;
+
+		traceFile_ = file;
+		if (trace_.IsOpen() && !trace_.Open(traceFile_))
+			return ERR_TRACE_FILE;
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(traceFile_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnTraceEventsWritten(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)trace_.EventsWritten());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnTraceEventsLost(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)trace_.EventsLost());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnStreamCaptureFile(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		string file;
+		pProp->Get(file);
+		if (file == captureFile_)
+			return DEVICE_OK;
+
+		capture_.Close();
+		captureFile_ = file;
+		if (!captureFile_.empty() && !capture_.Open(captureFile_, IMAGE_WIDTH, IMAGE_HEIGHT)) {
+			captureFile_.clear();
+			return ERR_CAPTURE_FILE;
+		}
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(captureFile_.c_str());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnStreamCaptureDropped(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set((long)capture_.FramesDropped());
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnReplaySpeed(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (streaming_)
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string speed;
+		pProp->Get(speed);
+		replay_.SetRealTime(speed != g_ReplaySpeed_Fast);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(replay_.GetRealTime() ? g_ReplaySpeed_Original : g_ReplaySpeed_Fast);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnIntervalPreWarm(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		pProp->Get(preWarmMs_);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(preWarmMs_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnIdleBetweenFrames(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::AfterSet)
+	{
+		if (IsCapturing())
+			return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+		string value;
+		pProp->Get(value);
+		idleBetweenFrames_ = (value == g_On);
+	}
+	else if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(idleBetweenFrames_ ? g_On : g_Off);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnScheduleJitter(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduleCount_ > 1 ? sqrt(scheduleM2_ / (scheduleCount_ - 1)) : 0.0);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::OnScheduleErrorMax(MM::PropertyBase* pProp, MM::ActionType eAct)
+{
+	if (eAct == MM::BeforeGet)
+	{
+		pProp->Set(scheduleMaxMs_);
+	}
+
+	return DEVICE_OK;
+}
+
+int Etaluma::ResizeImageBuffer()
+{
+	if (rois_.Empty())
+		img_.Resize(IMAGE_WIDTH / binning_, IMAGE_HEIGHT / binning_, bytesPerPixel_);
+	else
+		img_.Resize(rois_.PackedWidth(), rois_.MaxHeight(), bytesPerPixel_);
+	ResizePreviewBuffer();
+	UpdateKernel();
+
+	return DEVICE_OK;
+}
+
+// Follow the size and depth of img_ in the buffers derived from it.
+void Etaluma::ResizePreviewBuffer()
+{
+	if (previewDecimation_ > 1)
+		preview_.Resize(img_.Width() / previewDecimation_, img_.Height() / previewDecimation_, img_.Depth());
+	if (!rois_.Empty())
+		roiTile_.Resize(rois_.MaxWidth(), rois_.MaxHeight(), img_.Depth());
+}
+
+// The buffer handed to the core: the region tile in tagged ROI mode, the
+// preview when decimating, else img_.
+const ImgBuffer& Etaluma::OutputBuffer() const
+{
+	if (roiTagged_ && !rois_.Empty())
+		return roiTile_;
+	return previewOutput_ ? preview_ : img_;
+}
+
+void Etaluma::UpdatePreview()
+{
+	if (previewOutput_) {
+		decimator_.Decimate(img_.GetPixels(), img_.Width(), img_.Height(), img_.Depth(),
+			(unsigned)previewDecimation_, const_cast<unsigned char*>(preview_.GetPixels()));
+	}
+}
+
+// Stopping the stream only pays off when the interval leaves room for the
+// restart on top of the pre-warm lead. A warm stream is never stopped.
+bool Etaluma::IdleBetweenFrames(double intervalMs) const
+{
+	return idleBetweenFrames_ && !warmStream_ && intervalMs > 2 * preWarmMs_;
+}
+
+/**
+* Sleep until deadlineUs on the monotonic clock. Sleeps coarsely until the
+* last couple of milliseconds and yields from there, since SleepMs may
+* overshoot by a scheduler tick. With drain set, frames arriving meanwhile
+* are discarded so that the queue cannot overflow. Settings changed during
+* the sleep are applied as they come in. Returns false if the sequence was
+* stopped.
+*/
+bool Etaluma::SleepUntil(double deadlineUs, bool drain)
+{
+	for (;;) {
+		if (thd_->IsStopped())
+			return false;
+
+		ApplyPendingSettings();
+
+		if (drain) {
+			ReleaseFrame();
+			FrameQueue::Frame frame;
+			while (frameQueue_.Pop(frame))
+				frameQueue_.Release(frame);
+		}
+
+		double remainingMs = (deadlineUs - FrameQueue::Now()) / 1000.0;
+		if (remainingMs <= 0)
+			return true;
+		if (remainingMs > 2)
+			CDeviceUtils::SleepMs((long)min(remainingMs - 2, 50.0));
+		else
+			this_thread::yield();
+	}
+}
+
+// Running mean and variance of the scheduling error (Welford).
+void Etaluma::AddScheduleError(double errorMs)
+{
+	scheduleCount_++;
+	double delta = errorMs - scheduleMeanMs_;
+	scheduleMeanMs_ += delta / scheduleCount_;
+	scheduleM2_ += delta * (errorMs - scheduleMeanMs_);
+	scheduleMaxMs_ = max(scheduleMaxMs_, errorMs);
+}
+
+// Rate limit for images sent to the core during a sequence.
+bool Etaluma::PreviewDue()
+{
+	if (previewMaxFps_ <= 0)
+		return true;
+
+	double now = FrameQueue::Now();
+	if (lastPreviewUs_ > 0 && now - lastPreviewUs_ < 1e6 / previewMaxFps_)
+		return false;
+
+	lastPreviewUs_ = now;
+	return true;
+}
+
+int Etaluma::StartStream()
+{
+	if (streaming_ && !warmIdle_)
+		return DEVICE_OK;
+
+	if (streaming_) {
+		// Back to the selected clock. The transport thread is restarted on
+		// a fresh queue below, so the current overflow policy applies, and
+		// nothing from the idle time, an overflow that stopped the thread
+		// or dropped frames, carries over.
+		if (currentClockIndex_ != 0 && !WriteSetting(SettingsQueue::SETTING_PIXEL_CLOCK, (unsigned short)currentClockIndex_))
+			return DEVICE_CAN_NOT_SET_PROPERTY;
+		transportThd_->Stop();
+		transportThd_->wait();
+		ReleaseFrame();
+		warmIdle_ = false;
+	}
+
+	// The transport thread writes every byte of the pool, so it is the
+	// one whose node matters most.
+	int numaNode = -1;
+	if (numaLocalPool_)
+		numaNode = ThreadScheduling::NumaNodeOfCpu(transportCpu_ >= 0 ? transportCpu_ : processingCpu_);
+
+	// An unpaced replay must not lose frames to the queue, or runs would
+	// not be repeatable.
+	bool fastReplay = replay_.IsOpen() && !replay_.GetRealTime();
+	frameQueue_.SetOverflowPolicy(fastReplay ? FrameQueue::OVERFLOW_BLOCK : overflowPolicy_);
+	if (!frameQueue_.Allocate(IMAGE_WIDTH * IMAGE_HEIGHT * 3, frameQueueLength_, numaNode)) {
+		StopStream();
+		return DEVICE_OUT_OF_MEMORY;
+	}
+
+	if (!streaming_) {
+		replay_.Rewind();
+		if (!DeviceWrite(StreamFile::RECORD_STREAM_START, 0))
+			return ERR_STREAM_START_FAILED;
+		streaming_ = true;
+	}
+
+	framePeriodMs_ = 0;
+	lastFrameTimeUs_ = 0;
+	transportThd_->Start();
+	return DEVICE_OK;
+}
+
+/**
+* Make sure the shared memory ring exists and fits the images of the coming
+* sequence. An existing ring is kept, so readers stay attached across
+* sequences, unless it has to be replaced.
+*/
+int Etaluma::OpenSharedRing()
+{
+	if (sharedRingName_.empty())
+		return DEVICE_OK;
+
+	size_t frameBytes = (size_t)img_.Width() * img_.Height() * img_.Depth();
+	if (!sharedRing_.IsOpen() || sharedRing_.Name() != sharedRingName_ ||
+		sharedRing_.Slots() != (unsigned)sharedRingSlots_ || sharedRing_.FrameBytes() < frameBytes) {
+		if (!sharedRing_.Open(sharedRingName_, (unsigned)sharedRingSlots_, frameBytes))
+			return ERR_SHARED_MEMORY_FAILED;
+	}
+
+	sharedRing_.ResetCounters();
+	return DEVICE_OK;
+}
+
+/**
+* Done with the stream for now. A cold stream is stopped. A warm one keeps
+* running, but at the slowest pixel clock, the first of the table, so that
+* while idle it costs the bus and the transport thread a fraction of the
+* full rate. StartStream brings the selected clock back.
+*/
+void Etaluma::ReleaseStream()
+{
+	if (!warmStream_) {
+		StopStream();
+		return;
+	}
+	if (!streaming_ || warmIdle_)
+		return;
+
+	// Nothing pops the queue until the next StartStream, so the transport
+	// thread must not fill it, or an overflow would stop or block it.
+	transportThd_->SetIdle(true);
+	warmIdle_ = true;
+	if (currentClockIndex_ != 0 && !WriteSetting(SettingsQueue::SETTING_PIXEL_CLOCK, 0))
+		LogMessage("Could not slow down the idle warm stream", false);
+}
+
+void Etaluma::StopStream()
+{
+	warmIdle_ = false;
+	if (!streaming_)
+		return;
+
+	transportThd_->Stop();
+	transportThd_->wait();
+	DeviceWrite(StreamFile::RECORD_STREAM_STOP, 0);
+	ReleaseFrame();
+	streaming_ = false;
+}
+
+/**
+* Send a control write to the camera. Every write that changes what the
+* sensor delivers goes through here, so that a stream capture records it
+* and a replay can leave it out.
+*/
+bool Etaluma::DeviceWrite(StreamFile::RecordType type, unsigned short a, unsigned short b)
+{
+	capture_.WriteControl(type, a, b, FrameQueue::Now());
+	if (replay_.IsOpen())
+		return true;
+
+	switch (type)
+	{
+	case StreamFile::RECORD_STREAM_START:
+		return lumaUSB.StartStreaming();
+	case StreamFile::RECORD_STREAM_STOP:
+		return lumaUSB.StopStreaming();
+	case StreamFile::RECORD_EXPOSURE:
+		return sensor_->WriteExposure(a);
+	case StreamFile::RECORD_GLOBAL_GAIN:
+		return lumaUSB.SetGlobalGain(a);
+	case StreamFile::RECORD_PIXEL_CLOCK:
+		return lumaUSB.SetImageSensorPixelClockFrequency(a);
+	case StreamFile::RECORD_LED:
+		return lumaUSB.LedControllerWrite((unsigned char)a, (unsigned char)b);
+	default:
+		return false;
+	}
+}
+
+// Fetch the latest frame for the transport thread, from the replay file or
+// from LumaUSB, and capture it if a capture is running.
+bool Etaluma::ReadDeviceFrame(unsigned char* buffer, int* count)
+{
+	if (replay_.IsOpen()) {
+		if (!replay_.ReadFrame(buffer, count))
+			return false;
+	}
+	else if (!lumaUSB.GetLatest24bppBuffer(buffer, count)) {
+		return false;
+	}
+
+	capture_.WriteFrame(FrameQueue::Now(), buffer, *count);
+	return true;
+}
+
+int Etaluma::SetPixelClock(int index)
+{
+	// An idle warm stream gets the new clock when StartStream wakes it up.
+	if (!warmIdle_) {
+		int ret = ChangeSetting(SettingsQueue::SETTING_PIXEL_CLOCK, (unsigned short)index);
+		if (ret != DEVICE_OK)
+			return ret;
+	}
+
+	currentClockIndex_ = index;
+	currentClockFreqMHz_ = clockFreqMHz_[index];
+
+	// Rows are shorter or longer now, keep the exposure time.
+	return ChangeSetting(SettingsQueue::SETTING_EXPOSURE, ExposureRows(exposureMs_));
+}
+
+// Shutter width register value for an exposure at the current pixel clock.
+unsigned short Etaluma::ExposureRows(double exposureMs) const
+{
+	double rowUs = sensor_->RowTimeUs(currentClockIndex_);
+	double rows = (rowUs > 0) ? exposureMs * 1000.0 / rowUs : exposureMs;
+	return (unsigned short)max(1.0, min(65535.0, floor(rows + 0.5)));
+}
+
+/********************************************************************************
+* Pixel clock calibration.														*
+*																				*
+* Streams for g_CalibrationMs at every pixel clock and keeps the fastest one	*
+* that lost nothing on this host: no torn frames, no queue drops, and no more	*
+* USB traffic per delivered frame than the leanest clock, since surplus bytes	*
+* mean LumaUSB threw incomplete frames away. The choice is saved for the		*
+* current model and applied again at the next Initialize.						*
+********************************************************************************/
+int Etaluma::CalibratePixelClock()
+{
+	if (IsCapturing() || busy_)
+		return DEVICE_CAMERA_BUSY_ACQUIRING;
+
+	// A replay has no bus to measure.
+	if (replay_.IsOpen())
+		return DEVICE_NOT_SUPPORTED;
+
+	busy_ = true;
+	bool wasStreaming = streaming_;
+	StopStream();
+
+	string previousClock = currentClockFreqMHz_;
+	vector<ClockTrial> trials(clockFreqMHz_.size());
+	int ret = DEVICE_OK;
+	for (size_t i = 0; i < trials.size() && ret == DEVICE_OK; i++)
+		ret = MeasurePixelClock((int)i, trials[i]);
+
+	int best = -1;
+	if (ret == DEVICE_OK) {
+		double leanest = 0;
+		for (size_t i = 0; i < trials.size(); i++) {
+			if (trials[i].frames > 0 && (leanest == 0 || trials[i].bytesPerFrame < leanest))
+				leanest = trials[i].bytesPerFrame;
+		}
+
+		ostringstream os;
+		for (size_t i = 0; i < trials.size(); i++) {
+			const ClockTrial& t = trials[i];
+			bool clean = t.frames > 1 && t.torn == 0 && t.dropped == 0 &&
+				t.bytesPerFrame <= leanest * g_CalibrationExcessBytes;
+			if (clean && (best < 0 || t.fps > trials[best].fps))
+				best = (int)i;
+
+			os << clockFreqMHz_[i] << " MHz: " << t.fps << " fps, " << t.bytes << " bytes, " <<
+				t.torn << " torn, " << t.dropped << " dropped" << (clean ? "" : " (lossy)") << "; ";
+		}
+		os << "selected " << (best >= 0 ? clockFreqMHz_[best] + " MHz" : string("none"));
+		calibrationResult_ = os.str();
+		LogMessage("Pixel clock calibration: " + calibrationResult_, false);
+	}
+
+	if (best >= 0) {
+		ret = SetPixelClock(best);
+		if (ret == DEVICE_OK && !SavePixelClockCalibration(currentClockFreqMHz_))
+			LogMessage("Could not save the pixel clock calibration to " + calibrationFile_, false);
+	}
+	else {
+		SetPixelClock((int)(find(clockFreqMHz_.begin(), clockFreqMHz_.end(), previousClock) - clockFreqMHz_.begin()));
+		if (ret == DEVICE_OK)
+			ret = ERR_CALIBRATION_FAILED;
+	}
+	OnPropertyChanged(g_PixelClockMHz, currentClockFreqMHz_.c_str());
+
+	if (wasStreaming && ret == DEVICE_OK) {
+		ret = StartStream();
+		ReleaseStream();
+	}
+
+	busy_ = false;
+	return ret;
+}
+
+int Etaluma::MeasurePixelClock(int index, ClockTrial& trial)
+{
+	trial.frames = trial.torn = trial.dropped = trial.bytes = 0;
+	trial.fps = trial.bytesPerFrame = 0;
+
+	int ret = SetPixelClock(index);
+	if (ret != DEVICE_OK)
+		return ret;
+
+	ret = StartStream();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	// The frame in flight when the clock changed does not count.
+	WaitForFrame(g_FrameTimeoutMs);
+	unsigned long long tornBefore = frameQueue_.Torn();
+	unsigned long long droppedBefore = frameQueue_.Dropped();
+	lumaUSB.ResetNumBytesReceived();
+
+	double startUs = FrameQueue::Now();
+	double endUs = startUs + g_CalibrationMs * 1000.0;
+	double firstUs = 0, lastUs = 0;
+	while (FrameQueue::Now() < endUs && WaitForFrame((endUs - FrameQueue::Now()) / 1000.0)) {
+		if (trial.frames++ == 0)
+			firstUs = frame_.timestampUs;
+		lastUs = frame_.timestampUs;
+	}
+
+	lumaUSB.GetNumBytesReceived(trial.bytes);
+	trial.torn = frameQueue_.Torn() - tornBefore;
+	trial.dropped = frameQueue_.Dropped() - droppedBefore;
+	StopStream();
+
+	if (trial.frames > 1 && lastUs > firstUs)
+		trial.fps = (trial.frames - 1) * 1e6 / (lastUs - firstUs);
+	if (trial.frames > 0)
+		trial.bytesPerFrame = (double)trial.bytes / trial.frames;
+	return DEVICE_OK;
+}
+
+// The calibration file holds one "model=clock" line per camera model.
+bool Etaluma::LoadPixelClockCalibration(string& clockMHz)
+{
+	char model[MM::MaxStrLength];
+	GetProperty(g_CameraModelProperty, model);
+
+	ifstream file(calibrationFile_.c_str());
+	string line;
+	while (getline(file, line)) {
+		size_t sep = line.rfind('=');
+		if (sep != string::npos && line.compare(0, sep, model) == 0) {
+			clockMHz = line.substr(sep + 1);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Etaluma::SavePixelClockCalibration(const string& clockMHz)
+{
+	if (calibrationFile_.empty())
+		return false;
+
+	char model[MM::MaxStrLength];
+	GetProperty(g_CameraModelProperty, model);
+
+	// Keep the entries of the other models.
+	vector<string> lines;
+	{
+		ifstream file(calibrationFile_.c_str());
+		string line;
+		while (getline(file, line)) {
+			size_t sep = line.rfind('=');
+			if (!(sep != string::npos && line.compare(0, sep, model) == 0))
+				lines.push_back(line);
+		}
+	}
+	lines.push_back(string(model) + "=" + clockMHz);
+
+	ofstream file(calibrationFile_.c_str());
+	for (size_t i = 0; i < lines.size(); i++)
+		file << lines[i] << endl;
+	return file.good();
+}
+
+/**
+* Change a sensor setting. During a sequence the change is queued for the
+* acquisition thread, so the caller does not wait on USB and the sensor is
+* only touched between frames. Otherwise it is written right away.
+*/
+int Etaluma::ChangeSetting(SettingsQueue::Setting setting, unsigned short value)
+{
+	if (IsCapturing()) {
+		settings_.Post(setting, value);
+		return DEVICE_OK;
+	}
+
+	if (!WriteSetting(setting, value))
+		return DEVICE_CAN_NOT_SET_PROPERTY;
+	StartSettingsGeneration();
+	return DEVICE_OK;
+}
+
+bool Etaluma::WriteSetting(SettingsQueue::Setting setting, unsigned short value)
+{
+	switch (setting)
+	{
+	case SettingsQueue::SETTING_EXPOSURE:
+		return DeviceWrite(StreamFile::RECORD_EXPOSURE, value);
+	case SettingsQueue::SETTING_GLOBAL_GAIN:
+		return DeviceWrite(StreamFile::RECORD_GLOBAL_GAIN, value);
+	case SettingsQueue::SETTING_PIXEL_CLOCK:
+		return DeviceWrite(StreamFile::RECORD_PIXEL_CLOCK, value);
+	default:
+		return false;
+	}
+}
+
+// Write the settings queued since the last call, all under one new
+// generation. Called by the acquisition thread between frames.
+void Etaluma::ApplyPendingSettings()
+{
+	SettingsQueue::Batch batch;
+	if (!settings_.Take(batch))
+		return;
+
+	for (int s = 0; s < SettingsQueue::SETTING_COUNT; s++) {
+		if (batch.set[s] && !WriteSetting((SettingsQueue::Setting)s, batch.value[s]))
+			LogMessage("Failed to apply a camera setting changed during the sequence", false);
+	}
+	StartSettingsGeneration();
+}
+
+void Etaluma::StartSettingsGeneration()
+{
+	previousSettingsGeneration_ = settingsGeneration_;
+	settingsGeneration_++;
+	settingsAppliedUs_ = FrameQueue::Now();
+}
+
+/**
+* Take the next frame from the transport queue into frame_, handing the
+* previous one back to the pool. Returns false if no frame arrived within
+* timeoutMs or the queue overflowed under the stop policy.
+*/
+bool Etaluma::WaitForFrame(double timeoutMs)
+{
+	ReleaseFrame();
+
+	double deadlineUs = FrameQueue::Now() + timeoutMs * 1000.0;
+	do {
+		if (frameQueue_.Pop(frame_)) {
+			haveFrame_ = true;
+
+			// Track the frame period from the arrival stamps, it is used to
+			// work out when a frame started exposing.
+			if (lastFrameTimeUs_ > 0 && frame_.frameNumber > lastFrameNumber_) {
+				double intervalMs = (frame_.timestampUs - lastFrameTimeUs_) / 1000.0 /
+					(double)(frame_.frameNumber - lastFrameNumber_);
+				if (framePeriodMs_ == 0)
+					framePeriodMs_ = intervalMs;
+				else
+					framePeriodMs_ = 0.9 * framePeriodMs_ + 0.1 * intervalMs;
+			}
+			lastFrameTimeUs_ = frame_.timestampUs;
+			lastFrameNumber_ = frame_.frameNumber;
+			return true;
+		}
+		if (frameQueue_.Overflowed())
+			return false;
+		CDeviceUtils::SleepMs(1);
+	} while (FrameQueue::Now() < deadlineUs);
+
+	return false;
+}
+
+void Etaluma::ReleaseFrame()
+{
+	if (haveFrame_) {
+		frameQueue_.Release(frame_);
+		haveFrame_ = false;
+	}
+}
+
+// Apply the configured affinity and priority to the calling thread.
+void Etaluma::ConfigureCurrentThread(long cpu, const char* name)
+{
+	if (cpu < 0 && threadPriority_ == ThreadScheduling::PRIORITY_NORMAL)
+		return;
+
+	if (!ThreadScheduling::ConfigureCurrentThread((int)cpu, threadPriority_)) {
+		ostringstream os;
+		os << "Could not apply CPU " << cpu << " and the requested priority to the " << name << " thread";
+		LogMessage(os.str().c_str(), false);
+	}
+}
+
+// Error to report when WaitForFrame came back empty handed.
+int Etaluma::FrameError() const
+{
+	return frameQueue_.Overflowed() ? ERR_FRAME_QUEUE_OVERFLOW : ERR_FRAME_TIMEOUT;
+}
+
+/**
+* Wait for the first complete frame that started exposing at or after
+* startUs. Frames that completed before that are discarded, and so is the
+* frame that was being read out at startUs, unless the measured frame period
+* shows that it started after startUs.
+*/
+bool Etaluma::WaitForFrameStartedAfter(double startUs, double timeoutMs)
+{
+	double deadlineUs = startUs + timeoutMs * 1000.0;
+	bool first = true;
+	while (FrameQueue::Now() < deadlineUs) {
+		if (!WaitForFrame((deadlineUs - FrameQueue::Now()) / 1000.0))
+			return false;
+
+		if (frame_.timestampUs < startUs)
+			continue;
+
+		bool periodKnown = framePeriodMs_ > 0;
+		if (!first || (periodKnown && frame_.timestampUs - framePeriodMs_ * 1000.0 >= startUs))
+			return true;
+		first = false;
+	}
+
+	return false;
+}
+
+/**
+* Match the accumulator to the current settings and image size and start a
+* new block. Buffers are only reallocated when something changed.
+*/
+void Etaluma::PrepareAccumulator()
+{
+	size_t pixels = img_.Width() * img_.Height();
+	if (accumulator_.GetMode() != averagingMode_ ||
+		accumulator_.GetFrames() != (unsigned)framesToAverage_ ||
+		accumulator_.GetPixels() != pixels) {
+		accumulator_.Configure(averagingMode_, (unsigned)framesToAverage_, pixels);
+		accumulatorInput_.resize(accumulator_.IsActive() ? pixels : 0);
+	}
+	else {
+		accumulator_.Reset();
+	}
+}
+
+/**
+* Convert the frame in frame_ and pass it through the accumulator. Returns
+* true once img_ holds an image that should be delivered.
+*/
+bool Etaluma::ProcessFrame()
+{
+	unsigned char* pBuf = const_cast<unsigned char*>(img_.GetPixels());
+	if (!accumulator_.IsActive()) {
+		ConvertFrame(pBuf);
+		return true;
+	}
+
+	ConvertFrame(&accumulatorInput_[0]);
+	TraceScope scope(trace_, TraceLog::THREAD_ACQUISITION, "Accumulate", frame_.frameNumber);
+	return accumulator_.Add(&accumulatorInput_[0], pBuf);
+}
+
+/**
+* Convert the 24bpp frame in frame_ to 8 bit intensity in dst, honouring
+* the current ROI and binning, and patch the defective pixels. All of it
+* happens in one pass of the kernel picked by UpdateKernel.
+*/
+void Etaluma::ConvertFrame(unsigned char* pBuf)
+{
+	// Defect correction and statistics are fused into the kernel, so they
+	// are part of this span.
+	TraceScope scope(trace_, TraceLog::THREAD_ACQUISITION, activeDefects_ ? "Convert + Correct" : "Convert",
+		frame_.frameNumber);
+
+	if (!rois_.Empty()) {
+		ConvertRois(pBuf);
+		return;
+	}
+
+	FrameKernel::Params params;
+	params.src = frame_.pixels;
+	params.srcWidth = IMAGE_WIDTH;
+	params.x0 = roiX_ * binning_;
+	params.y0 = roiY_ * binning_;
+	params.width = img_.Width();
+	params.height = img_.Height();
+	params.dst = pBuf;
+	params.dstStride = img_.Width();
+	params.defects = activeDefects_;
+	params.stats = &stats_;
+	params.strip = 0;
+	params.stripContext = this;
+	params.stripRows = (unsigned)stripRows_;
+
+	if (stripRows_ == 0) {
+		kernel_(params);
+		return;
+	}
+
+	// Held for the whole frame, so consumers are not removed halfway.
+	MMThreadGuard g(stripLock_);
+	if (!stripConsumers_.empty()) {
+		params.strip = &Etaluma::DeliverStrip;
+		stripDst_ = pBuf;
+	}
+	kernel_(params);
+	for (size_t i = 0; i < stripConsumers_.size(); i++)
+		stripConsumers_[i]->OnFrameEnd(frame_.frameNumber);
+}
+
+// Strip callback of the conversion kernel.
+void Etaluma::DeliverStrip(void* context, unsigned firstRow, unsigned rows)
+{
+	Etaluma* camera = static_cast<Etaluma*>(context);
+	unsigned width = camera->img_.Width();
+	const unsigned char* pixels = camera->stripDst_ + (size_t)firstRow * width;
+	for (size_t i = 0; i < camera->stripConsumers_.size(); i++) {
+		camera->stripConsumers_[i]->OnStrip(camera->frame_.frameNumber, pixels,
+			width, camera->img_.Height(), firstRow, rows);
+	}
+}
+
+void Etaluma::AddStripConsumer(StripConsumer* consumer)
+{
+	MMThreadGuard g(stripLock_);
+	if (find(stripConsumers_.begin(), stripConsumers_.end(), consumer) == stripConsumers_.end())
+		stripConsumers_.push_back(consumer);
+}
+
+void Etaluma::RemoveStripConsumer(StripConsumer* consumer)
+{
+	MMThreadGuard g(stripLock_);
+	stripConsumers_.erase(remove(stripConsumers_.begin(), stripConsumers_.end(), consumer), stripConsumers_.end());
+}
+
+/**
+* Convert the regions of the ROI List straight into their columns of the
+* packed image in dst, walking the frame from top to bottom. Statistics
+* cover the regions only.
+*/
+void Etaluma::ConvertRois(unsigned char* pBuf)
+{
+	FrameKernel::Params params;
+	params.src = frame_.pixels;
+	params.srcWidth = IMAGE_WIDTH;
+	params.dstStride = rois_.PackedWidth();
+	params.stats = &roiStats_;
+	params.strip = 0;
+	if (frameStats_)
+		memset(&stats_, 0, sizeof(stats_));
+
+	const vector<size_t>& order = rois_.ReadOrder();
+	for (size_t k = 0; k < order.size(); k++) {
+		size_t i = order[k];
+		const RoiList::Roi& roi = rois_[i];
+		params.x0 = roi.x * binning_;
+		params.y0 = roi.y * binning_;
+		params.width = roi.width;
+		params.height = roi.height;
+		params.dst = pBuf + roi.column;
+		params.defects = roiDefects_.empty() ? 0 : roiDefects_[i];
+		kernel_(params);
+		if (frameStats_)
+			stats_.Add(roiStats_);
+	}
+
+	rois_.ClearBelow(pBuf);
+}
+
+// Pick the conversion kernel for the current settings. Runs whenever the
+// format, binning or ROI changes, never per frame.
+void Etaluma::UpdateKernel()
+{
+	bool crop = !rois_.Empty() || roiX_ != 0 || roiY_ != 0 ||
+		img_.Width() * binning_ != (unsigned)IMAGE_WIDTH || img_.Height() * binning_ != (unsigned)IMAGE_HEIGHT;
+	kernel_ = FrameKernel::Select(monoFormat_, binning_, crop, frameStats_);
+}
+
+// Pick the defect lists matching the current ROI, or each region of the ROI
+// List, and binning.
+void Etaluma::PrepareDefectCorrection()
+{
+	activeDefects_ = 0;
+	roiDefects_.clear();
+	if (!defectCorrection_ || defects_.Count() == 0)
+		return;
+
+	defects_.BeginSelect();
+
+	if (rois_.Empty()) {
+		activeDefects_ = &defects_.Select(roiX_, roiY_, img_.Width(), img_.Height(), binning_);
+		return;
+	}
+
+	for (size_t i = 0; i < rois_.Count(); i++)
+		roiDefects_.push_back(&defects_.Select(rois_[i].x, rois_[i].y, rois_[i].width, rois_[i].height, binning_));
+}
+
+/**
+* Average g_DefectCaptureFrames full sensor frames into frame, for defect
+* detection. Uses the stream like a snap, with ROI and averaging ignored.
+*/
+int Etaluma::CaptureSensorFrame(vector<unsigned char>& frame)
+{
+	size_t pixels = (size_t)IMAGE_WIDTH * IMAGE_HEIGHT;
+	vector<unsigned char> converted(pixels);
+	vector<unsigned short> sum(pixels, 0);
+
+	double startUs = FrameQueue::Now();
+	int ret = StartStream();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	bool ready = WaitForFrameStartedAfter(startUs, exposureMs_ + g_FrameTimeoutMs);
+	FrameKernel::Params params;
+	params.srcWidth = IMAGE_WIDTH;
+	params.x0 = params.y0 = 0;
+	params.width = IMAGE_WIDTH;
+	params.height = IMAGE_HEIGHT;
+	params.dst = &converted[0];
+	params.dstStride = IMAGE_WIDTH;
+	params.defects = 0;
+	params.stats = 0;
+	params.strip = 0;
+	FrameKernel::Function kernel = FrameKernel::Select(FrameKernel::FORMAT_LUMINANCE, 1, false, false);
+
+	for (int i = 0; ready && i < g_DefectCaptureFrames; i++) {
+		params.src = frame_.pixels;
+		kernel(params);
+		for (size_t p = 0; p < pixels; p++)
+			sum[p] = (unsigned short)(sum[p] + converted[p]);
+		if (i + 1 < g_DefectCaptureFrames)
+			ready = WaitForFrame(g_FrameTimeoutMs);
+	}
+	if (!ready)
+		ret = FrameError();
+
+	ReleaseStream();
+	if (ret != DEVICE_OK)
+		return ret;
+
+	frame.resize(pixels);
+	for (size_t p = 0; p < pixels; p++)
+		frame[p] = (unsigned char)((sum[p] + g_DefectCaptureFrames / 2) / g_DefectCaptureFrames);
+	return DEVICE_OK;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SequenceThread
+//
+// Acquisition thread used for sequence acquisitions. All USB reads during a
+// sequence happen on this thread.
+///////////////////////////////////////////////////////////////////////////////
+
+SequenceThread::SequenceThread(Etaluma* pCam) :
+	camera_(pCam),
+	stop_(true),
+	numImages_(0),
+	imageCounter_(0),
+	intervalMs_(0)
+{
+}
+
+SequenceThread::~SequenceThread() {}
+
+void SequenceThread::Stop()
+{
+	MMThreadGuard g(stopLock_);
+	stop_ = true;
+}
+
+void SequenceThread::Start(long numImages, double intervalMs)
+{
+	MMThreadGuard g(stopLock_);
+	numImages_ = numImages;
+	intervalMs_ = intervalMs;
+	imageCounter_ = 0;
+	stop_ = false;
+	activate();
+}
+
+bool SequenceThread::IsStopped()
+{
+	MMThreadGuard g(stopLock_);
+	return stop_;
+}
+
+int SequenceThread::svc(void) throw()
+{
+	int ret = DEVICE_ERR;
+	try
+	{
+		camera_->ConfigureCurrentThread(camera_->processingCpu_, "acquisition");
+		do
+		{
+			ret = camera_->AcquireSequenceFrame(imageCounter_);
+		} while (DEVICE_OK == ret && !IsStopped() && ++imageCounter_ < numImages_);
+
+		if (IsStopped())
+			camera_->LogMessage("SequenceThread stopped by the user");
+	}
+	catch (...)
+	{
+		camera_->LogMessage("Exception in SequenceThread::svc", false);
+	}
+
+	Stop();
+	camera_->OnThreadExiting();
+	return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TransportThread
+//
+// Producer side of the frame queue. Copies each frame LumaUSB completes into
+// a pool buffer and queues its descriptor; overflow is handled by the queue
+// according to the configured policy.
+///////////////////////////////////////////////////////////////////////////////
+
+TransportThread::TransportThread(Etaluma* pCam) :
+	camera_(pCam),
+	stop_(true),
+	idle_(false)
+{
+}
+
+TransportThread::~TransportThread() {}
+
+void TransportThread::Start()
+{
+	stop_.store(false, std::memory_order_release);
+	idle_.store(false, std::memory_order_release);
+	activate();
+}
+
+void TransportThread::Stop()
+{
+	stop_.store(true, std::memory_order_release);
+}
+
+int TransportThread::svc(void) throw()
+{
+	FrameQueue& queue = camera_->frameQueue_;
+
+	try
+	{
+		camera_->ConfigureCurrentThread(camera_->transportCpu_, "transport");
+		while (!stop_.load(std::memory_order_acquire)) {
+			unsigned char* buffer = queue.GetFillBuffer();
+			int count = (int)queue.GetFrameBytes();
+			if (buffer != 0 && camera_->ReadDeviceFrame(buffer, &count)) {
+				if (idle_.load(std::memory_order_acquire))
+					continue;
+
+				// LumaUSB finds the frame delimiters itself, a returned
+				// buffer is the first the adapter sees of a frame.
+				unsigned long long frameNumber = queue.NextFrameNumber();
+				camera_->trace_.Instant(TraceLog::THREAD_TRANSPORT, "USB Frame Complete", frameNumber);
+				if (count != (int)queue.GetFrameBytes()) {
+					camera_->trace_.Instant(TraceLog::THREAD_TRANSPORT, "Torn Frame", frameNumber);
+					queue.CountTorn();
+				}
+				else {
+					TraceScope scope(camera_->trace_, TraceLog::THREAD_TRANSPORT, "Queue Commit", frameNumber);
+					if (!queue.Commit(count, FrameQueue::Now(), stop_))
+						break;
+				}
+			}
+			else {
+				CDeviceUtils::SleepMs(1);
+			}
+		}
+	}
+	catch (...)
+	{
+		camera_->LogMessage("Exception in TransportThread::svc", false);
+	}
+
+	return 0;
 }
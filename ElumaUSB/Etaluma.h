@@ -30,13 +30,44 @@
 #include "ImgBuffer.h"
 #include "DeviceThreads.h"
 #include "ELumaUSB.h"
+#include "FrameAccumulator.h"
+#include "SensorModel.h"
+#include "FrameQueue.h"
+#include "ThreadScheduling.h"
+#include "LatencyHistogram.h"
+#include "FrameRecorder.h"
+#include "PreviewDecimator.h"
+#include "StreamFile.h"
+#include "DefectMap.h"
+#include "FrameKernel.h"
+#include "RoiList.h"
+#include "SharedFrameRing.h"
+#include "SettingsQueue.h"
+#include "StripConsumer.h"
+#include "ChangeDetector.h"
+#include "TraceLog.h"
 
 //////////////////////////////////////////////////////////////////////////////
 // Error codes
 //
 #define ERR_UNKNOWN_MODE         102
+#define ERR_FRAME_TIMEOUT        103
+#define ERR_LED_WRITE_FAILED     104
+#define ERR_INVALID_LED_SEQUENCE 105
+#define ERR_STREAM_START_FAILED  106
+#define ERR_FRAME_QUEUE_OVERFLOW 107
+#define ERR_RECORDING_FAILED     108
+#define ERR_CALIBRATION_FAILED   109
+#define ERR_REPLAY_FILE          110
+#define ERR_CAPTURE_FILE         111
+#define ERR_DEFECT_MAP_FILE      112
+#define ERR_ROI_LIST_ACTIVE      113
+#define ERR_SHARED_MEMORY_FAILED 114
+#define ERR_TRACE_FILE           115
+#define ERR_SENSOR_MISMATCH      116
 
 class SequenceThread;
+class TransportThread;
 
 class Etaluma : public CCameraBase<Etaluma>
 {
@@ -74,49 +105,339 @@ public:
 	int SetBinning(int binSize);
 	int IsExposureSequenceable(bool& seq) const { seq = false; return DEVICE_OK; }
 
+	// Strip delivery to native code in the same process. A consumer gets no
+	// more calls once RemoveStripConsumer returns.
+	void AddStripConsumer(StripConsumer* consumer);
+	void RemoveStripConsumer(StripConsumer* consumer);
+
 	// action interface
 	// ----------------
-	//int OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnBinning(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnMonoConversion(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameStatistics(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnGain(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnExposure(MM::PropertyBase* pProp, MM::ActionType eAct);
 	int OnPixelClock(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSnapMode(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameAveraging(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFramesToAverage(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameQueueLength(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnOverflowPolicy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFrameQueueOccupancy(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnFramesDropped(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnThreadCpu(MM::PropertyBase* pProp, MM::ActionType eAct, long thread);
+	int OnThreadPriority(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnNumaLocalPool(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLatencyPercentile(MM::PropertyBase* pProp, MM::ActionType eAct, long percentile);
+	int OnLedSequence(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnLedSettleFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPreviewDecimation(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPreviewMaxFps(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRecordingFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnIntervalPreWarm(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnIdleBetweenFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnScheduleJitter(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnScheduleErrorMax(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnCalibratePixelClock(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnCalibrationResult(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStreamCaptureFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStreamCaptureDropped(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnReplaySpeed(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDefectCorrection(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDefectMapCapture(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDefectThreshold(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnDefectCount(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRoiList(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnRoiOutput(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSharedMemoryRing(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSharedMemorySlots(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSharedMemoryFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnSharedMemoryThroughput(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnStripRows(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnChangeTrigger(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnChangeThreshold(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnChangeRowStep(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPreTriggerFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnPostTriggerFrames(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnChangeScore(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnChangeFramesSkipped(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTrace(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTraceFile(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTraceEventsWritten(MM::PropertyBase* pProp, MM::ActionType eAct);
+	int OnTraceEventsLost(MM::PropertyBase* pProp, MM::ActionType eAct);
 
 private:
 	friend class SequenceThread;
+	friend class TransportThread;
+
+	// Measurements of one pixel clock setting during calibration.
+	struct ClockTrial
+	{
+		unsigned long long frames;
+		unsigned long long torn;
+		unsigned long long dropped;
+		unsigned long long bytes;
+		double fps;
+		double bytesPerFrame;
+	};
+
+	// Why a frame was delivered under change-triggered capture.
+	enum Trigger
+	{
+		TRIGGER_NONE,		// change triggering is off
+		TRIGGER_PRE,		// held back before a trigger
+		TRIGGER_FRAME,		// the frame that changed
+		TRIGGER_POST		// delivered after a trigger
+	};
+
+	// Where the image in img_ came from. Kept apart from frame_ since
+	// change-triggered capture delivers frames after later ones arrived.
+	struct ImageTag
+	{
+		unsigned long long frameNumber;
+		long imageNumber;
+		double timestampUs;
+		int ledStep;
+		double scheduleErrorMs;
+		unsigned long settingsGeneration;
+		Trigger trigger;
+		double changeScore;
+	};
+
+	// A quiet frame waiting for a trigger.
+	struct PreTriggerFrame
+	{
+		vector<unsigned char> pixels;
+		ImageTag tag;
+		FrameKernel::Stats stats;
+	};
+
+	// One entry of the per-frame illumination sequence.
+	struct LedStep
+	{
+		unsigned char ledId;
+		unsigned char brightness;
+	};
+
 	int IMAGE_WIDTH;
 	int IMAGE_HEIGHT;
 	int MAX_BIT_DEPTH;
 
 	SequenceThread* thd_;
+	TransportThread* transportThd_;
 	int binning_;
 	int bytesPerPixel_;
 	double gain_;
 	double exposureMs_;
 	vector<string> clockFreqMHz_;
 	string currentClockFreqMHz_;
+	int currentClockIndex_;
 	bool initialized_;
 	ImgBuffer img_;
 	int roiX_, roiY_;
 	bool busy_;
+	bool stopOnOverflow_;
+
+	// Frames handed over by the transport thread. frame_ is the one the
+	// acquisition thread is working on, valid while haveFrame_ is set.
+	FrameQueue frameQueue_;
+	FrameQueue::OverflowPolicy overflowPolicy_;
+	long frameQueueLength_;
+	FrameQueue::Frame frame_;
+	bool haveFrame_;
+
+	// Scheduling of the transport and acquisition threads. A negative CPU
+	// leaves the thread unpinned.
+	long transportCpu_;
+	long processingCpu_;
+	ThreadScheduling::Priority threadPriority_;
+	bool numaLocalPool_;
+	LatencyHistogram latency_;
+
+	// Stream state. In warm stream mode the ISO stream is left running while
+	// idle so that snaps do not pay for a StartStreaming/StopStreaming cycle.
+	// While nothing uses it, it runs at the slowest pixel clock (warmIdle_).
+	bool streaming_;
+	bool warmStream_;
+	bool warmIdle_;
+	double lastFrameTimeUs_;
+	unsigned long long lastFrameNumber_;
+	double framePeriodMs_;
+
+	// Frame averaging
+	FrameAccumulator accumulator_;
+	FrameAccumulator::Mode averagingMode_;
+	long framesToAverage_;
+	vector<unsigned char> accumulatorInput_;
+
+	// LED sequencing
+	vector<LedStep> ledSequence_;
+	string ledSequenceText_;
+	long ledSettleFrames_;
+	int currentLedStep_;
+	int activeLedId_;
+
+	// Dual output. Full resolution frames go to the recording file, while
+	// the core gets a downsampled copy in preview_ at a capped rate during
+	// sequences (previewOutput_). Snaps are always full resolution.
+	FrameRecorder recorder_;
+	string recordingFile_;
+	PreviewDecimator decimator_;
+	ImgBuffer preview_;
+	long previewDecimation_;
+	bool previewOutput_;
+	double previewMaxFps_;
+	double lastPreviewUs_;
+
+	// Time-lapse scheduling. Frame k of a sequence is due at
+	// sequenceStartUs_ + k * interval. For long intervals the stream is
+	// stopped between frames and restarted preWarmMs_ before the deadline.
+	double sequenceStartUs_;
+	double preWarmMs_;
+	bool idleBetweenFrames_;
+	bool scheduled_;
+	double scheduleErrorMs_;
+	long scheduleCount_;
+	double scheduleMeanMs_;
+	double scheduleM2_;
+	double scheduleMaxMs_;
+
+	// Pixel clock calibration, persisted per model in calibrationFile_.
+	string calibrationFile_;
+	string calibrationResult_;
+
+	// Stream capture and replay. While replaying, frames come from replay_
+	// instead of LumaUSB and control writes are not sent to the device.
+	StreamCapture capture_;
+	string captureFile_;
+	StreamReplay replay_;
+
+	// Defect pixel correction. activeDefects_ is the defect list for the
+	// current ROI and binning, picked before each acquisition, or null when
+	// correction is off.
+	DefectMap defects_;
+	const vector<unsigned>* activeDefects_;
+
+	// Conversion kernel for the current format, binning and ROI, reselected
+	// whenever one of them changes.
+	FrameKernel::Format monoFormat_;
+	FrameKernel::Function kernel_;
+
+	// Statistics of the last converted frame, computed by the kernel when
+	// frameStats_ is set and attached to the image metadata.
+	bool frameStats_;
+	FrameKernel::Stats stats_;
+	bool defectCorrection_;
+	long defectThreshold_;
+	string defectMapFile_;
+
+	// Multiple ROIs. While rois_ is set it replaces the single ROI: img_
+	// holds the packed image of all regions, and in tagged mode each region
+	// goes to the core on its own, padded to a common size in roiTile_.
+	RoiList rois_;
+	bool roiTagged_;
+	ImgBuffer roiTile_;
+	vector<const vector<unsigned>*> roiDefects_;
+	FrameKernel::Stats roiStats_;
+
+	// Shared memory ring for local consumers. Every frame of a sequence is
+	// published, whatever the preview rate. The ring is created when a
+	// sequence starts and kept until its name changes.
+	SharedFrameWriter sharedRing_;
+	string sharedRingName_;
+	long sharedRingSlots_;
+
+	// Gain, exposure and pixel clock changes made during a sequence wait in
+	// settings_ until the acquisition thread is between frames. Every
+	// applied change starts a new settings generation, and each image is
+	// stamped with the generation it was exposed under.
+	SettingsQueue settings_;
+	unsigned long settingsGeneration_;
+	unsigned long previousSettingsGeneration_;
+	double settingsAppliedUs_;
+	ImageTag imageTag_;
+
+	// Strip consumers get each converted frame in bands of stripRows_ rows
+	// while the kernel is still working on the rows below. stripDst_ is the
+	// image being converted.
+	MMThreadLock stripLock_;
+	vector<StripConsumer*> stripConsumers_;
+	long stripRows_;
+	const unsigned char* stripDst_;
+
+	// Change-triggered capture. Frames scoring below changeThresh_ against
+	// the last delivered one wait in the preTrigger_ ring, which drops the
+	// oldest as new ones come in. A frame at or above it is delivered after
+	// them, followed by postTriggerFrames_ more.
+	ChangeDetector changeDetector_;
+	bool changeTrigger_;
+	double changeThreshold_;
+	long changeRowStep_;
+	long preTriggerFrames_;
+	long postTriggerFrames_;
+	long postTriggerLeft_;
+	vector<PreTriggerFrame> preTrigger_;
+	size_t preTriggerStart_;
+	size_t preTriggerCount_;
+	double changeScore_;
+	unsigned long long changeSkipped_;
+
+	// Pipeline trace, opened and closed by the Trace property at any time.
+	TraceLog trace_;
+	string traceFile_;
 
 	int ResizeImageBuffer();
-	void GenerateImage();
-	int InsertImage();
+	void ResizePreviewBuffer();
+	const ImgBuffer& OutputBuffer() const;
+	void UpdatePreview();
+	bool PreviewDue();
+	bool IdleBetweenFrames(double intervalMs) const;
+	bool SleepUntil(double deadlineUs, bool drain);
+	void AddScheduleError(double errorMs);
+	int SetPixelClock(int index);
+	unsigned short ExposureRows(double exposureMs) const;
+	bool DeviceWrite(StreamFile::RecordType type, unsigned short a, unsigned short b = 0);
+	bool ReadDeviceFrame(unsigned char* buffer, int* count);
+	int CalibratePixelClock();
+	int MeasurePixelClock(int index, ClockTrial& trial);
+	bool LoadPixelClockCalibration(string& clockMHz);
+	bool SavePixelClockCalibration(const string& clockMHz);
+	int DeliverImage(bool always = false);
+	int DeliverOnChange();
+	void PrepareChangeTrigger();
+	void StorePreTriggerFrame(size_t limit);
+	int InsertImage(int roiIndex = -1);
+	int InsertRoiImages();
+	int StartStream();
+	void ReleaseStream();
+	int OpenSharedRing();
+	void StopStream();
+	int ChangeSetting(SettingsQueue::Setting setting, unsigned short value);
+	bool WriteSetting(SettingsQueue::Setting setting, unsigned short value);
+	void ApplyPendingSettings();
+	void StartSettingsGeneration();
+	bool WaitForFrame(double timeoutMs);
+	bool WaitForFrameStartedAfter(double startUs, double timeoutMs);
+	void ReleaseFrame();
+	int FrameError() const;
+	void ConfigureCurrentThread(long cpu, const char* name);
+	void ConvertFrame(unsigned char* dst);
+	void ConvertRois(unsigned char* dst);
+	static void DeliverStrip(void* context, unsigned firstRow, unsigned rows);
+	void UpdateKernel();
+	void AddStatistics(Metadata& md) const;
+	void PrepareDefectCorrection();
+	int CaptureSensorFrame(vector<unsigned char>& frame);
+	bool ProcessFrame();
+	void PrepareAccumulator();
+	int ApplyLedStep(const LedStep& step);
+	int AcquireSequenceFrame(long frameIndex);
+	void OnThreadExiting() throw();
 
 	ELumaUSB lumaUSB;
-	signed int PID_FX2_DEV;
+	EtalumaSensor::SensorModel* sensor_;
 	signed int PID_LSCOPE;
 	signed int VID_CYPRESS;
-	unsigned char IMAGE_SENSOR_BLUE_GAIN;
-	unsigned char IMAGE_SENSOR_GLOBAL_GAIN;
-	unsigned char IMAGE_SENSOR_GREEN1_GAIN;
-	unsigned char IMAGE_SENSOR_GREEN2_GAIN;
-	unsigned char IMAGE_SENSOR_RED_GAIN;
-	unsigned char IMAGE_SENSOR_RESET;
-	unsigned char IMAGE_SENSOR_SHUTTER_WIDTH_LOWER;
-	unsigned char MAX_GLOBAL_GAIN_PARAMETER_VALUE;
-	signed int MAX_IMAGE_SENSOR_EXPOSURE;
-	signed int RECOMMENDED_MIN_GLOBAL_GAIN_PARAMETER_VALUE;
 };
 
 class SequenceThread : public MMDeviceThreadBase
@@ -135,10 +456,31 @@ public:
 private:
 	int svc(void) throw();
 	Etaluma* camera_;
+	MMThreadLock stopLock_;
 	bool stop_;
 	long numImages_;
 	long imageCounter_;
 	double intervalMs_;
 };
 
+// Pulls reassembled frames out of LumaUSB and queues them for the
+// acquisition thread. Runs while the stream is on and never takes a lock.
+class TransportThread : public MMDeviceThreadBase
+{
+public:
+	TransportThread(Etaluma* pCam);
+	~TransportThread();
+	void Start();
+	void Stop();
+
+	// While idle, frames are read and dropped instead of queued.
+	void SetIdle(bool idle) { idle_.store(idle, std::memory_order_release); }
+
+private:
+	int svc(void) throw();
+	Etaluma* camera_;
+	std::atomic<bool> stop_;
+	std::atomic<bool> idle_;
+};
+
 #endif //_MMCAMERA_H_
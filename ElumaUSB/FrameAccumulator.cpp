@@ -0,0 +1,202 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameAccumulator.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Frame averaging and accumulation for the Etaluma adapter.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "FrameAccumulator.h"
+#include <emmintrin.h>
+#include <algorithm>
+
+using namespace std;
+
+// Largest frame count whose 8 bit sum still fits a 16 bit accumulator.
+const unsigned g_Max16BitFrames = 65535 / 255;
+
+FrameAccumulator::FrameAccumulator() :
+	mode_(MODE_OFF),
+	frames_(1),
+	count_(0),
+	pixels_(0),
+	primed_(false)
+{
+}
+
+void FrameAccumulator::Configure(Mode mode, unsigned frames, size_t pixels)
+{
+	mode_ = mode;
+	frames_ = max(frames, 1u);
+	pixels_ = pixels;
+
+	bool running = (mode_ == MODE_RUNNING_AVERAGE);
+	bool wide = (mode_ == MODE_AVERAGE || mode_ == MODE_SUM) && frames_ > g_Max16BitFrames;
+	acc16_.assign(wide || running ? 0 : pixels_, 0);
+	acc32_.assign(wide ? pixels_ : 0, 0);
+	running_.assign(running ? pixels_ : 0, 0.0f);
+
+	Reset();
+}
+
+void FrameAccumulator::Reset()
+{
+	count_ = 0;
+	primed_ = false;
+	fill(acc16_.begin(), acc16_.end(), (unsigned short)0);
+	fill(acc32_.begin(), acc32_.end(), 0u);
+	fill(running_.begin(), running_.end(), 0.0f);
+}
+
+bool FrameAccumulator::Add(const unsigned char* frame, unsigned char* dst)
+{
+	if (mode_ == MODE_RUNNING_AVERAGE) {
+		Running(frame, dst);
+		return true;
+	}
+
+	if (acc32_.empty())
+		Add16(frame);
+	else
+		Add32(frame);
+
+	if (++count_ < frames_)
+		return false;
+
+	Emit(dst);
+	Reset();
+	return true;
+}
+
+void FrameAccumulator::Add16(const unsigned char* frame)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned short* acc = &acc16_[0];
+	size_t i = 0;
+
+	for (; i + 16 <= pixels_; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(frame + i));
+		__m128i a0 = _mm_loadu_si128((const __m128i*)(acc + i));
+		__m128i a1 = _mm_loadu_si128((const __m128i*)(acc + i + 8));
+		a0 = _mm_add_epi16(a0, _mm_unpacklo_epi8(v, zero));
+		a1 = _mm_add_epi16(a1, _mm_unpackhi_epi8(v, zero));
+		_mm_storeu_si128((__m128i*)(acc + i), a0);
+		_mm_storeu_si128((__m128i*)(acc + i + 8), a1);
+	}
+
+	for (; i < pixels_; i++)
+		acc[i] = (unsigned short)(acc[i] + frame[i]);
+}
+
+void FrameAccumulator::Add32(const unsigned char* frame)
+{
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int* acc = &acc32_[0];
+	size_t i = 0;
+
+	for (; i + 16 <= pixels_; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(frame + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i w[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+		};
+		for (int k = 0; k < 4; k++) {
+			__m128i a = _mm_loadu_si128((const __m128i*)(acc + i + 4 * k));
+			_mm_storeu_si128((__m128i*)(acc + i + 4 * k), _mm_add_epi32(a, w[k]));
+		}
+	}
+
+	for (; i < pixels_; i++)
+		acc[i] += frame[i];
+}
+
+// Exponential running average, state += (frame - state) / N. The state is
+// float rather than fixed point: with 8.8 fixed point the frame term of a
+// 1/1024 weight is frame / 4, which snaps the output to multiples of 4 grey
+// levels and biases it low. Outputs are rounded to nearest by cvtps2dq in
+// the SIMD body and cvtss2si in the tail alike, so a constant input
+// converges to itself.
+void FrameAccumulator::Running(const unsigned char* frame, unsigned char* dst)
+{
+	float* state = &running_[0];
+	size_t i = 0;
+
+	if (!primed_) {
+		for (; i < pixels_; i++) {
+			state[i] = (float)frame[i];
+			dst[i] = frame[i];
+		}
+		primed_ = true;
+		return;
+	}
+
+	const float weight = 1.0f / (float)frames_;
+	const __m128 w = _mm_set1_ps(weight);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 16 <= pixels_; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)(frame + i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		__m128i x[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero)
+		};
+		__m128i out[4];
+		for (int k = 0; k < 4; k++) {
+			__m128 s = _mm_loadu_ps(state + i + 4 * k);
+			s = _mm_add_ps(s, _mm_mul_ps(_mm_sub_ps(_mm_cvtepi32_ps(x[k]), s), w));
+			_mm_storeu_ps(state + i + 4 * k, s);
+			out[k] = _mm_cvtps_epi32(s);
+		}
+		__m128i o0 = _mm_packs_epi32(out[0], out[1]);
+		__m128i o1 = _mm_packs_epi32(out[2], out[3]);
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(o0, o1));
+	}
+
+	for (; i < pixels_; i++) {
+		state[i] += ((float)frame[i] - state[i]) * weight;
+		int o = _mm_cvtss_si32(_mm_set_ss(state[i]));
+		dst[i] = (unsigned char)min(max(o, 0), 255);
+	}
+}
+
+// Write the result of a completed block. This runs once every N frames, so
+// plain scalar code is fine here.
+void FrameAccumulator::Emit(unsigned char* dst)
+{
+	const unsigned half = frames_ / 2;
+
+	if (mode_ == MODE_SUM) {
+		unsigned short* out = reinterpret_cast<unsigned short*>(dst);
+		if (acc32_.empty())
+			copy(acc16_.begin(), acc16_.end(), out);
+		else
+			for (size_t i = 0; i < pixels_; i++)
+				out[i] = (unsigned short)min(acc32_[i], 65535u);
+		return;
+	}
+
+	if (acc32_.empty())
+		for (size_t i = 0; i < pixels_; i++)
+			dst[i] = (unsigned char)((acc16_[i] + half) / frames_);
+	else
+		for (size_t i = 0; i < pixels_; i++)
+			dst[i] = (unsigned char)((acc32_[i] + half) / frames_);
+}
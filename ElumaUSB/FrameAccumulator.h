@@ -0,0 +1,78 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameAccumulator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Frame averaging and accumulation for the Etaluma adapter.
+//				  Frames are added into a 16 or 32 bit accumulator with SSE2
+//				  on the acquisition thread, so only the averaged or summed
+//				  result has to be handed to the core.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _FRAMEACCUMULATOR_H_
+#define _FRAMEACCUMULATOR_H_
+
+#include <vector>
+#include <cstddef>
+
+class FrameAccumulator
+{
+public:
+	enum Mode
+	{
+		MODE_OFF,
+		MODE_AVERAGE,			// emit the mean of every N frames
+		MODE_SUM,				// emit the 16 bit sum of every N frames
+		MODE_RUNNING_AVERAGE	// emit every frame, smoothed with weight 1/N
+	};
+
+	FrameAccumulator();
+
+	void Configure(Mode mode, unsigned frames, size_t pixels);
+	void Reset();
+
+	Mode GetMode() const { return mode_; }
+	unsigned GetFrames() const { return frames_; }
+	size_t GetPixels() const { return pixels_; }
+	bool IsActive() const { return mode_ == MODE_SUM || (mode_ != MODE_OFF && frames_ > 1); }
+
+	// Add an 8 bit frame. Returns true when a result is ready, in which case
+	// it has been written to dst: 8 bit pixels for the average modes, 16 bit
+	// pixels for MODE_SUM.
+	bool Add(const unsigned char* frame, unsigned char* dst);
+
+private:
+	void Add16(const unsigned char* frame);
+	void Add32(const unsigned char* frame);
+	void Running(const unsigned char* frame, unsigned char* dst);
+	void Emit(unsigned char* dst);
+
+	Mode mode_;
+	unsigned frames_;
+	unsigned count_;
+	size_t pixels_;
+	bool primed_;
+
+	// 16 bit accumulation holds up to 257 frames of 8 bit data. Longer runs
+	// fall back to 32 bit. The running average keeps its state in float, so
+	// that a weight of 1/1024 still moves it by fractions of a grey level.
+	std::vector<unsigned short> acc16_;
+	std::vector<unsigned int> acc32_;
+	std::vector<float> running_;
+};
+
+#endif //_FRAMEACCUMULATOR_H_
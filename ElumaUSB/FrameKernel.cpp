@@ -0,0 +1,104 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameKernel.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Dispatch table of the Etaluma frame conversion kernels.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "FrameKernel.h"
+
+namespace FrameKernel
+{
+	// Indexed by [format][binning 1, 2, 4][crop][stats].
+#define FRAME_KERNEL_ROW(format, bin) \
+	{ \
+		{ &Convert<format, bin, false, false>, &Convert<format, bin, false, true> }, \
+		{ &Convert<format, bin, true, false>, &Convert<format, bin, true, true> } \
+	}
+
+	static const Function g_Kernels[2][3][2][2] =
+	{
+		{
+			FRAME_KERNEL_ROW(FORMAT_LUMINANCE, 1),
+			FRAME_KERNEL_ROW(FORMAT_LUMINANCE, 2),
+			FRAME_KERNEL_ROW(FORMAT_LUMINANCE, 4)
+		},
+		{
+			FRAME_KERNEL_ROW(FORMAT_GREEN, 1),
+			FRAME_KERNEL_ROW(FORMAT_GREEN, 2),
+			FRAME_KERNEL_ROW(FORMAT_GREEN, 4)
+		}
+	};
+
+#undef FRAME_KERNEL_ROW
+
+	Function Select(Format format, unsigned binning, bool crop, bool stats)
+	{
+		int binIndex;
+		switch (binning)
+		{
+		case 1: binIndex = 0; break;
+		case 2: binIndex = 1; break;
+		case 4: binIndex = 2; break;
+		default: return 0;
+		}
+
+		return g_Kernels[format == FORMAT_GREEN ? 1 : 0][binIndex][crop ? 1 : 0][stats ? 1 : 0];
+	}
+
+	unsigned long long Stats::Count(int channel) const
+	{
+		unsigned long long n = 0;
+		for (int i = 0; i < 256; i++)
+			n += histogram[channel][i];
+		return n;
+	}
+
+	unsigned Stats::Min(int channel) const
+	{
+		for (unsigned i = 0; i < 256; i++)
+			if (histogram[channel][i] != 0)
+				return i;
+		return 0;
+	}
+
+	unsigned Stats::Max(int channel) const
+	{
+		for (unsigned i = 256; i-- > 0;)
+			if (histogram[channel][i] != 0)
+				return i;
+		return 0;
+	}
+
+	void Stats::Add(const Stats& other)
+	{
+		for (int c = 0; c < CHANNEL_COUNT; c++)
+			for (int i = 0; i < 256; i++)
+				histogram[c][i] += other.histogram[c][i];
+	}
+
+	double Stats::Mean(int channel) const
+	{
+		unsigned long long n = 0, sum = 0;
+		for (int i = 0; i < 256; i++) {
+			n += histogram[channel][i];
+			sum += (unsigned long long)i * histogram[channel][i];
+		}
+		return n ? (double)sum / n : 0.0;
+	}
+}
@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameKernel.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Single pass conversion of reassembled 24bpp Etaluma frames
+//				  to 8 bit images. Mono conversion, ROI crop, binning and
+//				  defect correction, and optionally per-frame statistics,
+//				  are fused into one kernel, instantiated for every
+//				  compile-time combination of them, so each frame is read
+//				  once and the image written once.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _FRAMEKERNEL_H_
+#define _FRAMEKERNEL_H_
+
+#include "DefectMap.h"
+#include <vector>
+#include <cstring>
+
+namespace FrameKernel
+{
+	enum Format
+	{
+		FORMAT_LUMINANCE,	// (r + 2g + b) / 4
+		FORMAT_GREEN		// green channel only
+	};
+
+	// Histograms of one frame. Minimum, maximum, mean and saturation are
+	// all derived from them, so the kernel only has to count.
+	struct Stats
+	{
+		// Source channels in LumaUSB byte order (B, G, R, as in a Windows
+		// 24bpp bitmap), and the converted image.
+		enum Channel
+		{
+			CHANNEL_BLUE,
+			CHANNEL_GREEN,
+			CHANNEL_RED,
+			CHANNEL_IMAGE,
+			CHANNEL_COUNT
+		};
+
+		unsigned histogram[CHANNEL_COUNT][256];
+
+		unsigned long long Count(int channel) const;
+		unsigned Min(int channel) const;
+		unsigned Max(int channel) const;
+		double Mean(int channel) const;
+		unsigned Saturated(int channel) const { return histogram[channel][255]; }
+
+		// Accumulate the histograms of another part of the same frame.
+		void Add(const Stats& other);
+	};
+
+	struct Params
+	{
+		const unsigned char* src;	// 24bpp frame
+		unsigned srcWidth;			// sensor pixels per row
+		unsigned x0, y0;			// crop origin in sensor pixels
+		unsigned width, height;		// output size in binned pixels
+		unsigned char* dst;
+		size_t dstStride;			// bytes from one dst row to the next
+		const std::vector<unsigned>* defects;	// sorted output indices, or null
+		Stats* stats;				// filled by the WithStats kernels
+
+		// Called each time stripRows more rows of dst are final, and for
+		// the rest at the end. Null to skip.
+		void (*strip)(void* context, unsigned firstRow, unsigned rows);
+		void* stripContext;
+		unsigned stripRows;
+	};
+
+	typedef void (*Function)(const Params& p);
+
+	// Weighted channel sum of one pixel, and the shift that turns a sum of
+	// Bin x Bin of them into an 8 bit mean.
+	template <Format F> struct Pixel;
+
+	template <> struct Pixel<FORMAT_LUMINANCE>
+	{
+		static unsigned Sum(const unsigned char* px) { return px[0] + 2 * px[1] + px[2]; }
+		static const unsigned shift = 2;
+	};
+
+	template <> struct Pixel<FORMAT_GREEN>
+	{
+		static unsigned Sum(const unsigned char* px) { return px[1]; }
+		static const unsigned shift = 0;
+	};
+
+	template <unsigned Bin> struct Log2;
+	template <> struct Log2<1> { static const unsigned value = 0; };
+	template <> struct Log2<2> { static const unsigned value = 1; };
+	template <> struct Log2<4> { static const unsigned value = 2; };
+
+	// Patch the defects of row y, whose neighbour rows are both final by now.
+	// Returns the cursor past the last defect of the row.
+	inline size_t CorrectRow(const Params& p, size_t cursor, unsigned y)
+	{
+		const std::vector<unsigned>& defects = *p.defects;
+		const unsigned rowEnd = (y + 1) * p.width;
+		for (; cursor < defects.size() && defects[cursor] < rowEnd; cursor++)
+			DefectMap::CorrectPixel(p.dst, p.width, p.height, p.dstStride, defects, cursor);
+		return cursor;
+	}
+
+	// Counting alternates between two sub-histograms, so that neighbouring
+	// pixels with the same value do not serialize on one counter.
+	typedef unsigned SubHistograms[2][Stats::CHANNEL_COUNT][256];
+
+	inline void CountImageRow(SubHistograms& hist, const Params& p, unsigned y)
+	{
+		const unsigned char* row = p.dst + y * p.dstStride;
+		unsigned x = 0;
+		for (; x + 1 < p.width; x += 2) {
+			hist[0][Stats::CHANNEL_IMAGE][row[x]]++;
+			hist[1][Stats::CHANNEL_IMAGE][row[x + 1]]++;
+		}
+		if (x < p.width)
+			hist[0][Stats::CHANNEL_IMAGE][row[x]]++;
+	}
+
+	// Make row y final: patch its defects and count it.
+	template <bool WithStats>
+	inline size_t FinishRow(SubHistograms& hist, const Params& p, size_t cursor, unsigned y)
+	{
+		if (p.defects != 0)
+			cursor = CorrectRow(p, cursor, y);
+		if (WithStats)
+			CountImageRow(hist, p, y);
+		return cursor;
+	}
+
+	/**
+	* Convert one frame. Output rows are produced top to bottom. Each row is
+	* finished, its defects patched and its values counted, as soon as the
+	* row below it exists, so that work runs on data still in cache. Finished
+	* rows are handed to the strip callback in bands. Without Crop the frame
+	* origin is fixed at the sensor origin.
+	*/
+	template <Format F, unsigned Bin, bool Crop, bool WithStats>
+	void Convert(const Params& p)
+	{
+		const size_t srcStride = (size_t)p.srcWidth * 3;
+		const unsigned shift = Pixel<F>::shift + 2 * Log2<Bin>::value;
+		const unsigned char* origin = Crop ? p.src + (size_t)p.y0 * srcStride + (size_t)p.x0 * 3 : p.src;
+		size_t cursor = 0;
+		unsigned delivered = 0;
+
+		SubHistograms hist;
+		if (WithStats)
+			memset(hist, 0, sizeof(hist));
+
+		for (unsigned y = 0; y < p.height; y++) {
+			const unsigned char* row = origin + (size_t)y * Bin * srcStride;
+			unsigned char* dst = p.dst + y * p.dstStride;
+
+			for (unsigned x = 0; x < p.width; x++) {
+				const unsigned char* block = row + (size_t)x * Bin * 3;
+				unsigned sum = 0;
+				for (unsigned by = 0; by < Bin; by++) {
+					for (unsigned bx = 0; bx < Bin; bx++) {
+						const unsigned char* px = block + by * srcStride + bx * 3;
+						sum += Pixel<F>::Sum(px);
+						if (WithStats) {
+							unsigned (&h)[Stats::CHANNEL_COUNT][256] = hist[(x * Bin + bx) & 1];
+							h[Stats::CHANNEL_BLUE][px[0]]++;
+							h[Stats::CHANNEL_GREEN][px[1]]++;
+							h[Stats::CHANNEL_RED][px[2]]++;
+						}
+					}
+				}
+				dst[x] = (unsigned char)(sum >> shift);
+			}
+
+			if (y > 0) {
+				cursor = FinishRow<WithStats>(hist, p, cursor, y - 1);
+				if (p.strip != 0 && y - delivered >= p.stripRows) {
+					p.strip(p.stripContext, delivered, y - delivered);
+					delivered = y;
+				}
+			}
+		}
+
+		if (p.height > 0)
+			FinishRow<WithStats>(hist, p, cursor, p.height - 1);
+		if (p.strip != 0 && delivered < p.height)
+			p.strip(p.stripContext, delivered, p.height - delivered);
+
+		if (WithStats) {
+			for (int c = 0; c < Stats::CHANNEL_COUNT; c++)
+				for (int i = 0; i < 256; i++)
+					p.stats->histogram[c][i] = hist[0][c][i] + hist[1][c][i];
+		}
+	}
+
+	// Kernel for a runtime combination of settings, looked up in a table of
+	// all instantiations. Returns null for an unsupported binning.
+	Function Select(Format format, unsigned binning, bool crop, bool stats);
+}
+
+#endif //_FRAMEKERNEL_H_
@@ -0,0 +1,176 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameQueue.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hand-off of frames between the USB transport thread and the
+//				  acquisition thread of the Etaluma adapter.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "FrameQueue.h"
+#include "ThreadScheduling.h"
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+FrameQueue::FrameQueue() :
+	policy_(OVERFLOW_DROP_OLDEST),
+	frameBytes_(0),
+	numaNode_(-1),
+	fillIndex_(-1),
+	frameNumber_(0),
+	dropped_(0),
+	torn_(0),
+	overflowed_(false)
+{
+}
+
+FrameQueue::~FrameQueue()
+{
+	FreePool();
+}
+
+bool FrameQueue::Allocate(size_t frameBytes, size_t capacity, int numaNode)
+{
+	if (capacity < 1)
+		capacity = 1;
+
+	// One buffer for the producer to fill and one for the consumer to work
+	// on, on top of the queued ones.
+	size_t buffers = capacity + 2;
+	if (frameBytes != frameBytes_ || buffers != pool_.size() || numaNode != numaNode_) {
+		FreePool();
+		frameBytes_ = frameBytes;
+		numaNode_ = numaNode;
+		for (size_t i = 0; i < buffers; i++) {
+			unsigned char* buffer = static_cast<unsigned char*>(ThreadScheduling::AllocateBuffer(frameBytes, numaNode));
+			if (buffer == 0) {
+				FreePool();
+				return false;
+			}
+			pool_.push_back(buffer);
+		}
+	}
+
+	ring_.Allocate(capacity);
+	free_.Allocate(buffers);
+	Reset();
+	return true;
+}
+
+void FrameQueue::Reset()
+{
+	ring_.Clear();
+	free_.Clear();
+	spare_.clear();
+	for (int i = 0; i < (int)pool_.size(); i++)
+		free_.TryPush(i);
+
+	fillIndex_ = -1;
+	frameNumber_ = 0;
+	dropped_.store(0, memory_order_relaxed);
+	torn_.store(0, memory_order_relaxed);
+	overflowed_.store(false, memory_order_release);
+}
+
+void FrameQueue::FreePool()
+{
+	for (size_t i = 0; i < pool_.size(); i++)
+		ThreadScheduling::FreeBuffer(pool_[i], frameBytes_);
+	pool_.clear();
+}
+
+bool FrameQueue::TakeFreeBuffer()
+{
+	if (!spare_.empty()) {
+		fillIndex_ = spare_.back();
+		spare_.pop_back();
+		return true;
+	}
+	return free_.TryPop(fillIndex_);
+}
+
+unsigned char* FrameQueue::GetFillBuffer()
+{
+	if (fillIndex_ < 0 && !TakeFreeBuffer())
+		return 0;
+	return pool_[fillIndex_];
+}
+
+bool FrameQueue::Commit(int bytes, double timestampUs, const atomic<bool>& abort)
+{
+	if (fillIndex_ < 0)
+		return true;
+
+	Frame frame;
+	frame.pixels = pool_[fillIndex_];
+	frame.bytes = bytes;
+	frame.bufferIndex = fillIndex_;
+	frame.frameNumber = frameNumber_++;
+	frame.timestampUs = timestampUs;
+
+	while (!ring_.TryPush(frame)) {
+		switch (policy_)
+		{
+		case OVERFLOW_DROP_OLDEST:
+		{
+			// The consumer may win the race for the oldest frame, in which
+			// case there is room now anyway.
+			Frame oldest;
+			if (ring_.TryDropOldest(oldest)) {
+				spare_.push_back(oldest.bufferIndex);
+				dropped_.fetch_add(1, memory_order_relaxed);
+			}
+			break;
+		}
+		case OVERFLOW_DROP_NEWEST:
+			// Keep the fill buffer, the next frame overwrites this one.
+			dropped_.fetch_add(1, memory_order_relaxed);
+			return true;
+		case OVERFLOW_BLOCK:
+			if (abort.load(memory_order_acquire))
+				return false;
+			this_thread::yield();
+			break;
+		case OVERFLOW_STOP:
+		default:
+			dropped_.fetch_add(1, memory_order_relaxed);
+			overflowed_.store(true, memory_order_release);
+			return false;
+		}
+	}
+
+	fillIndex_ = -1;
+	return true;
+}
+
+bool FrameQueue::Pop(Frame& frame)
+{
+	return ring_.TryPop(frame);
+}
+
+void FrameQueue::Release(const Frame& frame)
+{
+	free_.TryPush(frame.bufferIndex);
+}
+
+double FrameQueue::Now()
+{
+	return (double)chrono::duration_cast<chrono::microseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
@@ -0,0 +1,196 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameQueue.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Hand-off of frames between the USB transport thread and the
+//				  acquisition thread of the Etaluma adapter. Frames live in a
+//				  preallocated pool and are passed as small descriptors
+//				  through a bounded single-producer/single-consumer ring, so
+//				  the transport side never takes a lock.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _FRAMEQUEUE_H_
+#define _FRAMEQUEUE_H_
+
+#include <atomic>
+#include <vector>
+#include <cstddef>
+
+// Size used to keep producer and consumer indices on separate cache lines.
+#define FRAME_QUEUE_CACHE_LINE 64
+
+// Bounded ring of trivially copyable items. Exactly one thread may push and
+// one thread may pop. The producer may also discard the oldest item, which
+// is why the tail is advanced with a compare-and-swap: a pop that loses the
+// race to a discard simply retries on the next item.
+template <class T>
+class SpscRing
+{
+public:
+	SpscRing() : head_(0), tail_(0), mask_(0), capacity_(0) {}
+
+	// Capacity is rounded up to a power of two.
+	void Allocate(size_t capacity)
+	{
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		slots_.assign(size, T());
+		mask_ = size - 1;
+		capacity_ = capacity;
+		Clear();
+	}
+
+	void Clear()
+	{
+		head_.store(0, std::memory_order_relaxed);
+		tail_.store(0, std::memory_order_relaxed);
+	}
+
+	size_t Capacity() const { return capacity_; }
+
+	size_t Size() const
+	{
+		return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+	}
+
+	// Producer
+	bool TryPush(const T& item)
+	{
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head - tail_.load(std::memory_order_acquire) >= capacity_)
+			return false;
+		slots_[head & mask_] = item;
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Producer: remove the oldest item to make room.
+	bool TryDropOldest(T& item)
+	{
+		return Take(item);
+	}
+
+	// Consumer
+	bool TryPop(T& item)
+	{
+		return Take(item);
+	}
+
+private:
+	bool Take(T& item)
+	{
+		size_t tail = tail_.load(std::memory_order_acquire);
+		for (;;) {
+			if (tail == head_.load(std::memory_order_acquire))
+				return false;
+			item = slots_[tail & mask_];
+			if (tail_.compare_exchange_weak(tail, tail + 1, std::memory_order_acq_rel, std::memory_order_acquire))
+				return true;
+		}
+	}
+
+	// Padded rather than alignas'd so that owners can still be created with
+	// plain operator new.
+	char padHead_[FRAME_QUEUE_CACHE_LINE];
+	std::atomic<size_t> head_;
+	char padTail_[FRAME_QUEUE_CACHE_LINE - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> tail_;
+	char padSlots_[FRAME_QUEUE_CACHE_LINE - sizeof(std::atomic<size_t>)];
+	std::vector<T> slots_;
+	size_t mask_;
+	size_t capacity_;
+};
+
+class FrameQueue
+{
+public:
+	enum OverflowPolicy
+	{
+		OVERFLOW_DROP_OLDEST,
+		OVERFLOW_DROP_NEWEST,
+		OVERFLOW_BLOCK,
+		OVERFLOW_STOP
+	};
+
+	// Descriptor of a frame held in the pool.
+	struct Frame
+	{
+		const unsigned char* pixels;
+		int bytes;
+		int bufferIndex;
+		unsigned long long frameNumber;
+		double timestampUs;
+	};
+
+	FrameQueue();
+	~FrameQueue();
+
+	// Allocate capacity queued frames of frameBytes each, plus one buffer for
+	// each side, on numaNode if it is not negative. Must not be called while
+	// either side is running. Returns false if the pool could not be
+	// allocated.
+	bool Allocate(size_t frameBytes, size_t capacity, int numaNode);
+	void Reset();
+
+	void SetOverflowPolicy(OverflowPolicy policy) { policy_ = policy; }
+	OverflowPolicy GetOverflowPolicy() const { return policy_; }
+
+	// Producer side. The fill buffer stays owned by the producer until
+	// Commit hands it over. Commit returns false once the queue overflowed
+	// under OVERFLOW_STOP, or when abort was raised while blocking.
+	unsigned char* GetFillBuffer();
+	size_t GetFrameBytes() const { return frameBytes_; }
+	unsigned long long NextFrameNumber() const { return frameNumber_; }
+	bool Commit(int bytes, double timestampUs, const std::atomic<bool>& abort);
+
+	// Producer side. Count a frame that arrived incomplete and was not queued.
+	void CountTorn() { torn_.fetch_add(1, std::memory_order_relaxed); }
+
+	// Consumer side. A popped frame must be released before the next pop.
+	bool Pop(Frame& frame);
+	void Release(const Frame& frame);
+
+	size_t Occupancy() const { return ring_.Size(); }
+	size_t Capacity() const { return ring_.Capacity(); }
+	unsigned long long Dropped() const { return dropped_.load(std::memory_order_relaxed); }
+	unsigned long long Torn() const { return torn_.load(std::memory_order_relaxed); }
+	bool Overflowed() const { return overflowed_.load(std::memory_order_acquire); }
+
+	// Monotonic clock used to stamp frames.
+	static double Now();
+
+private:
+	bool TakeFreeBuffer();
+	void FreePool();
+
+	OverflowPolicy policy_;
+	size_t frameBytes_;
+	int numaNode_;
+	std::vector<unsigned char*> pool_;
+	SpscRing<Frame> ring_;
+	SpscRing<int> free_;	// released buffers, consumer to producer
+	std::vector<int> spare_;	// buffers reclaimed by the producer itself
+	int fillIndex_;
+	unsigned long long frameNumber_;
+	std::atomic<unsigned long long> dropped_;
+	std::atomic<unsigned long long> torn_;
+	std::atomic<bool> overflowed_;
+};
+
+#endif //_FRAMEQUEUE_H_
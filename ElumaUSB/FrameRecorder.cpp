@@ -0,0 +1,135 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameRecorder.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Full resolution recording path of the Etaluma adapter.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "FrameRecorder.h"
+#include "DeviceUtils.h"
+#include <cstring>
+
+using namespace std;
+
+FrameRecorder::FrameRecorder() :
+	file_(0),
+	frameBytes_(0),
+	writer_(this),
+	closing_(false),
+	failed_(false),
+	written_(0)
+{
+}
+
+FrameRecorder::~FrameRecorder()
+{
+	Close();
+}
+
+bool FrameRecorder::Open(const string& path, unsigned width, unsigned height, unsigned bytesPerPixel, size_t queueLength)
+{
+	Close();
+
+	file_ = fopen(path.c_str(), "wb");
+	if (file_ == 0)
+		return false;
+
+	const char magic[8] = { 'E', 'T', 'L', 'R', 'E', 'C', '0', '1' };
+	unsigned int header[3] = { width, height, bytesPerPixel };
+	if (fwrite(magic, sizeof(magic), 1, file_) != 1 || fwrite(header, sizeof(header), 1, file_) != 1) {
+		fclose(file_);
+		file_ = 0;
+		return false;
+	}
+
+	frameBytes_ = (size_t)width * height * bytesPerPixel;
+	pool_.assign(queueLength, vector<unsigned char>(frameBytes_));
+	queue_.Allocate(queueLength);
+	free_.Allocate(queueLength);
+	for (int i = 0; i < (int)queueLength; i++)
+		free_.TryPush(i);
+
+	closing_.store(false);
+	failed_.store(false);
+	written_.store(0);
+	writer_.activate();
+	return true;
+}
+
+bool FrameRecorder::Record(const unsigned char* pixels, unsigned long long frameNumber, double timestampUs, int ledChannel)
+{
+	if (file_ == 0)
+		return false;
+
+	Slot slot;
+	while (!free_.TryPop(slot.buffer)) {
+		if (failed_.load(memory_order_acquire))
+			return false;
+		CDeviceUtils::SleepMs(1);
+	}
+
+	memcpy(&pool_[slot.buffer][0], pixels, frameBytes_);
+	slot.frameNumber = frameNumber;
+	slot.timestampUs = timestampUs;
+	slot.ledChannel = ledChannel;
+	queue_.TryPush(slot);
+
+	return !failed_.load(memory_order_acquire);
+}
+
+void FrameRecorder::Close()
+{
+	if (file_ == 0)
+		return;
+
+	closing_.store(true, memory_order_release);
+	writer_.wait();
+
+	fclose(file_);
+	file_ = 0;
+}
+
+int FrameRecorder::WriteLoop()
+{
+	for (;;) {
+		Slot slot;
+		if (!queue_.TryPop(slot)) {
+			if (closing_.load(memory_order_acquire))
+				break;
+			CDeviceUtils::SleepMs(1);
+			continue;
+		}
+
+		if (!failed_.load(memory_order_relaxed)) {
+			int reserved = 0;
+			bool ok = fwrite(&slot.frameNumber, sizeof(slot.frameNumber), 1, file_) == 1 &&
+				fwrite(&slot.timestampUs, sizeof(slot.timestampUs), 1, file_) == 1 &&
+				fwrite(&slot.ledChannel, sizeof(slot.ledChannel), 1, file_) == 1 &&
+				fwrite(&reserved, sizeof(reserved), 1, file_) == 1 &&
+				fwrite(&pool_[slot.buffer][0], 1, frameBytes_, file_) == frameBytes_;
+			if (ok)
+				written_.fetch_add(1, memory_order_relaxed);
+			else
+				failed_.store(true, memory_order_release);
+		}
+
+		free_.TryPush(slot.buffer);
+	}
+
+	return 0;
+}
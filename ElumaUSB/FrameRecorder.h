@@ -0,0 +1,91 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          FrameRecorder.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Full resolution recording path of the Etaluma adapter.
+//				  Frames are copied into a small queue by the acquisition
+//				  thread and written to disk by a dedicated writer thread.
+//
+//				  File layout, all values little endian:
+//				    header   "ETLREC01", uint32 width, uint32 height,
+//				             uint32 bytesPerPixel
+//				    frames   uint64 frameNumber, double timestampUs,
+//				             int32 ledChannel, int32 reserved, pixels
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _FRAMERECORDER_H_
+#define _FRAMERECORDER_H_
+
+#include "DeviceThreads.h"
+#include "FrameQueue.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <atomic>
+
+class FrameRecorder
+{
+public:
+	FrameRecorder();
+	~FrameRecorder();
+
+	bool Open(const std::string& path, unsigned width, unsigned height, unsigned bytesPerPixel, size_t queueLength);
+
+	// Copy a frame into the write queue. Blocks while the writer is behind,
+	// so frames are never dropped on the way to disk. Returns false once a
+	// write failed.
+	bool Record(const unsigned char* pixels, unsigned long long frameNumber, double timestampUs, int ledChannel);
+
+	// Write out everything still queued and close the file.
+	void Close();
+
+	bool IsOpen() const { return file_ != 0; }
+	unsigned long long FramesWritten() const { return written_.load(std::memory_order_relaxed); }
+
+private:
+	struct Slot
+	{
+		int buffer;
+		unsigned long long frameNumber;
+		double timestampUs;
+		int ledChannel;
+	};
+
+	class WriterThread : public MMDeviceThreadBase
+	{
+	public:
+		WriterThread(FrameRecorder* recorder) : recorder_(recorder) {}
+		int svc(void) throw() { return recorder_->WriteLoop(); }
+	private:
+		FrameRecorder* recorder_;
+	};
+
+	int WriteLoop();
+
+	FILE* file_;
+	size_t frameBytes_;
+	std::vector<std::vector<unsigned char> > pool_;
+	SpscRing<Slot> queue_;		// acquisition thread to writer
+	SpscRing<int> free_;		// writer to acquisition thread
+	WriterThread writer_;
+	std::atomic<bool> closing_;
+	std::atomic<bool> failed_;
+	std::atomic<unsigned long long> written_;
+};
+
+#endif //_FRAMERECORDER_H_
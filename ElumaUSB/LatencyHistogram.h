@@ -0,0 +1,78 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          LatencyHistogram.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Fixed-size latency histogram with percentile lookup. Updated
+//				  from the acquisition thread and read from property handlers
+//				  without locking.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _LATENCYHISTOGRAM_H_
+#define _LATENCYHISTOGRAM_H_
+
+#include <atomic>
+
+// Bins are 0.1 ms wide up to 100 ms; anything slower lands in the last bin.
+class LatencyHistogram
+{
+public:
+	static const int BIN_COUNT = 1001;
+
+	LatencyHistogram() { Reset(); }
+
+	void Reset()
+	{
+		for (int i = 0; i < BIN_COUNT; i++)
+			bins_[i].store(0, std::memory_order_relaxed);
+		count_.store(0, std::memory_order_relaxed);
+	}
+
+	void Add(double ms)
+	{
+		int bin = ms <= 0 ? 0 : (int)(ms * 10.0);
+		if (bin >= BIN_COUNT)
+			bin = BIN_COUNT - 1;
+		bins_[bin].fetch_add(1, std::memory_order_relaxed);
+		count_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	unsigned long Count() const { return count_.load(std::memory_order_relaxed); }
+
+	// Upper edge of the bin holding the given percentile, in ms.
+	double Percentile(double percent) const
+	{
+		unsigned long total = Count();
+		if (total == 0)
+			return 0;
+
+		unsigned long rank = (unsigned long)(total * percent / 100.0 + 0.5);
+		unsigned long seen = 0;
+		for (int i = 0; i < BIN_COUNT; i++) {
+			seen += bins_[i].load(std::memory_order_relaxed);
+			if (seen >= rank && seen > 0)
+				return (i + 1) / 10.0;
+		}
+		return BIN_COUNT / 10.0;
+	}
+
+private:
+	std::atomic<unsigned long> bins_[BIN_COUNT];
+	std::atomic<unsigned long> count_;
+};
+
+#endif //_LATENCYHISTOGRAM_H_
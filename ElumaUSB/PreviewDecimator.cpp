@@ -0,0 +1,100 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PreviewDecimator.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Box-filter downsampling used for the Etaluma live preview.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "PreviewDecimator.h"
+#include <emmintrin.h>
+#include <cstring>
+
+void PreviewDecimator::Decimate(const unsigned char* src, unsigned width, unsigned height,
+	unsigned bytesPerPixel, unsigned factor, unsigned char* dst)
+{
+	if (factor <= 1) {
+		memcpy(dst, src, (size_t)width * height * bytesPerPixel);
+		return;
+	}
+
+	// 4x is two 2x passes, the intermediate image goes through scratch_.
+	const unsigned char* in = src;
+	for (unsigned f = factor; f > 1; f >>= 1) {
+		unsigned char* out = dst;
+		if (f > 2) {
+			scratch_.resize((size_t)(width / 2) * (height / 2) * bytesPerPixel);
+			out = &scratch_[0];
+		}
+
+		if (bytesPerPixel == 2)
+			Half16(reinterpret_cast<const unsigned short*>(in), width, height, reinterpret_cast<unsigned short*>(out));
+		else
+			Half8(in, width, height, out);
+
+		in = out;
+		width /= 2;
+		height /= 2;
+	}
+}
+
+// 2x2 box average, rounded as in Half16. Each 16 bit lane of a row holds
+// one horizontal pair, which is split into its even and odd byte and
+// summed with the pair below, so no intermediate result is rounded.
+void PreviewDecimator::Half8(const unsigned char* src, unsigned width, unsigned height, unsigned char* dst)
+{
+	const unsigned outWidth = width / 2;
+	const unsigned outHeight = height / 2;
+	const __m128i evenMask = _mm_set1_epi16(0x00FF);
+	const __m128i two = _mm_set1_epi16(2);
+
+	for (unsigned y = 0; y < outHeight; y++) {
+		const unsigned char* r0 = src + (size_t)(2 * y) * width;
+		const unsigned char* r1 = r0 + width;
+		unsigned char* out = dst + (size_t)y * outWidth;
+
+		unsigned x = 0;
+		for (; x + 16 <= outWidth; x += 16) {
+			__m128i sums[2];
+			for (int half = 0; half < 2; half++) {
+				__m128i a = _mm_loadu_si128((const __m128i*)(r0 + 2 * x + 16 * half));
+				__m128i b = _mm_loadu_si128((const __m128i*)(r1 + 2 * x + 16 * half));
+				__m128i sum = _mm_add_epi16(_mm_and_si128(a, evenMask), _mm_srli_epi16(a, 8));
+				sum = _mm_add_epi16(sum, _mm_add_epi16(_mm_and_si128(b, evenMask), _mm_srli_epi16(b, 8)));
+				sums[half] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+			}
+			_mm_storeu_si128((__m128i*)(out + x), _mm_packus_epi16(sums[0], sums[1]));
+		}
+
+		for (; x < outWidth; x++)
+			out[x] = (unsigned char)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+	}
+}
+
+void PreviewDecimator::Half16(const unsigned short* src, unsigned width, unsigned height, unsigned short* dst)
+{
+	const unsigned outWidth = width / 2;
+	const unsigned outHeight = height / 2;
+
+	for (unsigned y = 0; y < outHeight; y++) {
+		const unsigned short* r0 = src + (size_t)(2 * y) * width;
+		const unsigned short* r1 = r0 + width;
+		unsigned short* out = dst + (size_t)y * outWidth;
+		for (unsigned x = 0; x < outWidth; x++)
+			out[x] = (unsigned short)(((unsigned)r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+	}
+}
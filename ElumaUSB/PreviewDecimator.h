@@ -0,0 +1,43 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          PreviewDecimator.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Box-filter downsampling used for the Etaluma live preview.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _PREVIEWDECIMATOR_H_
+#define _PREVIEWDECIMATOR_H_
+
+#include <vector>
+
+class PreviewDecimator
+{
+public:
+	// Downsample src by factor (1, 2 or 4) in both directions into dst,
+	// which must hold (width / factor) * (height / factor) pixels.
+	void Decimate(const unsigned char* src, unsigned width, unsigned height,
+		unsigned bytesPerPixel, unsigned factor, unsigned char* dst);
+
+private:
+	static void Half8(const unsigned char* src, unsigned width, unsigned height, unsigned char* dst);
+	static void Half16(const unsigned short* src, unsigned width, unsigned height, unsigned short* dst);
+
+	std::vector<unsigned char> scratch_;
+};
+
+#endif //_PREVIEWDECIMATOR_H_
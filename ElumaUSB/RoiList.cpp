@@ -0,0 +1,123 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          RoiList.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Several rectangular regions read from each Etaluma frame.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "RoiList.h"
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+
+using namespace std;
+
+RoiList::RoiList() :
+	packedWidth_(0),
+	maxWidth_(0),
+	maxHeight_(0)
+{
+}
+
+bool RoiList::Parse(const string& text, unsigned sensorWidth, unsigned sensorHeight)
+{
+	vector<Roi> rois;
+	istringstream list(text);
+	string entry;
+	while (getline(list, entry, ';')) {
+		if (entry.find_first_not_of(" \t") == string::npos)
+			continue;
+
+		// "x,y,w,h". Extracting an unsigned accepts a minus sign and wraps.
+		if (entry.find('-') != string::npos)
+			return false;
+		istringstream is(entry);
+		Roi roi;
+		char c1, c2, c3;
+		if (!(is >> roi.x >> c1 >> roi.y >> c2 >> roi.width >> c3 >> roi.height) ||
+			c1 != ',' || c2 != ',' || c3 != ',')
+			return false;
+		is >> ws;
+		if (!is.eof())
+			return false;
+
+		// Compared without adding, which could wrap as well.
+		if (roi.width == 0 || roi.height == 0 ||
+			roi.x >= sensorWidth || roi.width > sensorWidth - roi.x ||
+			roi.y >= sensorHeight || roi.height > sensorHeight - roi.y)
+			return false;
+		rois.push_back(roi);
+	}
+
+	rois_.swap(rois);
+	packedWidth_ = maxWidth_ = maxHeight_ = 0;
+	order_.resize(rois_.size());
+	for (size_t i = 0; i < rois_.size(); i++) {
+		rois_[i].column = packedWidth_;
+		packedWidth_ += rois_[i].width;
+		maxWidth_ = max(maxWidth_, rois_[i].width);
+		maxHeight_ = max(maxHeight_, rois_[i].height);
+		order_[i] = i;
+	}
+
+	stable_sort(order_.begin(), order_.end(),
+		[this](size_t a, size_t b) { return rois_[a].y < rois_[b].y; });
+	return true;
+}
+
+string RoiList::Format() const
+{
+	ostringstream os;
+	for (size_t i = 0; i < rois_.size(); i++) {
+		os << (i ? ";" : "") << rois_[i].x << "," << rois_[i].y << ","
+			<< rois_[i].width << "," << rois_[i].height;
+	}
+	return os.str();
+}
+
+void RoiList::Clear()
+{
+	Parse("", 0, 0);
+}
+
+void RoiList::ClearBelow(unsigned char* packed) const
+{
+	for (size_t i = 0; i < rois_.size(); i++) {
+		const Roi& roi = rois_[i];
+		for (unsigned y = roi.height; y < maxHeight_; y++)
+			memset(packed + (size_t)y * packedWidth_ + roi.column, 0, roi.width);
+	}
+}
+
+void RoiList::ExtractTile(const unsigned char* packed, unsigned depth, size_t i, unsigned char* tile) const
+{
+	const Roi& roi = rois_[i];
+	const size_t packedStride = (size_t)packedWidth_ * depth;
+	const size_t tileStride = (size_t)maxWidth_ * depth;
+	const size_t rowBytes = (size_t)roi.width * depth;
+	for (unsigned y = 0; y < maxHeight_; y++) {
+		unsigned char* dst = tile + y * tileStride;
+		if (y < roi.height) {
+			memcpy(dst, packed + y * packedStride + (size_t)roi.column * depth, rowBytes);
+			memset(dst + rowBytes, 0, tileStride - rowBytes);
+		}
+		else {
+			memset(dst, 0, tileStride);
+		}
+	}
+}
@@ -0,0 +1,83 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          RoiList.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Several rectangular regions read from each Etaluma frame.
+//				  The regions are converted side by side into one packed
+//				  image, and can be cut out of it again as equally sized
+//				  tiles.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _ROILIST_H_
+#define _ROILIST_H_
+
+#include <vector>
+#include <string>
+
+class RoiList
+{
+public:
+	// A region in binned pixels. column is where it starts in the packed
+	// image.
+	struct Roi
+	{
+		unsigned x, y;
+		unsigned width, height;
+		unsigned column;
+	};
+
+	RoiList();
+
+	// Parse "x,y,w,h;x,y,w,h;...", all in binned pixels. Every region must
+	// lie inside a sensorWidth x sensorHeight image. An empty text clears
+	// the list. On error the list is left unchanged and false is returned.
+	bool Parse(const std::string& text, unsigned sensorWidth, unsigned sensorHeight);
+	std::string Format() const;
+	void Clear();
+
+	bool Empty() const { return rois_.empty(); }
+	size_t Count() const { return rois_.size(); }
+	const Roi& operator[](size_t i) const { return rois_[i]; }
+
+	// Indices of the regions by top row, the order in which a frame should
+	// be read so that it is walked from top to bottom.
+	const std::vector<size_t>& ReadOrder() const { return order_; }
+
+	// The packed image is PackedWidth() x MaxHeight(), regions side by side
+	// in list order, with the rows below shorter regions left black.
+	unsigned PackedWidth() const { return packedWidth_; }
+	unsigned MaxWidth() const { return maxWidth_; }
+	unsigned MaxHeight() const { return maxHeight_; }
+
+	// Blacken the rows of an 8 bit packed image below the regions that are
+	// shorter than MaxHeight(). The regions themselves are left alone.
+	void ClearBelow(unsigned char* packed) const;
+
+	// Copy region i of a packed image with depth bytes per pixel into a
+	// MaxWidth() x MaxHeight() tile, black outside the region.
+	void ExtractTile(const unsigned char* packed, unsigned depth, size_t i, unsigned char* tile) const;
+
+private:
+	std::vector<Roi> rois_;
+	std::vector<size_t> order_;
+	unsigned packedWidth_;
+	unsigned maxWidth_;
+	unsigned maxHeight_;
+};
+
+#endif //_ROILIST_H_
@@ -0,0 +1,221 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SensorModel.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Native description of the image sensors in the Etaluma 600
+//				  and 700 series. The register map, gain and exposure limits
+//				  and pixel clock table are compile-time constants, so the
+//				  adapter only calls into LumaUSB.dll for actual USB I/O.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _SENSORMODEL_H_
+#define _SENSORMODEL_H_
+
+#include "ELumaUSB.h"
+#include <cstdlib>
+#include <string>
+
+namespace EtalumaSensor
+{
+	// Registers used by the adapter. Addresses are looked up per model at
+	// compile time through RegisterMap below.
+	enum Register
+	{
+		REG_SHUTTER_WIDTH_LOWER,
+		REG_RESET,
+		REG_GREEN1_GAIN,
+		REG_BLUE_GAIN,
+		REG_RED_GAIN,
+		REG_GREEN2_GAIN,
+		REG_GLOBAL_GAIN
+	};
+
+	// Model tags
+	struct Lumascope600 {};
+	struct Lumascope700 {};
+
+	// Register address of R on Model. Only registers that exist on a model are
+	// specialized, so using any other one fails to compile.
+	template <class Model, Register R> struct RegisterMap;
+
+	// Both models carry the same Aptina sensor, so they share its map.
+#define ETALUMA_SENSOR_REGISTER(model, reg, address) \
+	template <> struct RegisterMap<model, reg> { static constexpr unsigned short value = address; }
+
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_SHUTTER_WIDTH_LOWER, 0x09);
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_RESET, 0x0D);
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_GREEN1_GAIN, 0x2B);
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_BLUE_GAIN, 0x2C);
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_RED_GAIN, 0x2D);
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_GREEN2_GAIN, 0x2E);
+	ETALUMA_SENSOR_REGISTER(Lumascope600, REG_GLOBAL_GAIN, 0x35);
+
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_SHUTTER_WIDTH_LOWER, 0x09);
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_RESET, 0x0D);
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_GREEN1_GAIN, 0x2B);
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_BLUE_GAIN, 0x2C);
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_RED_GAIN, 0x2D);
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_GREEN2_GAIN, 0x2E);
+	ETALUMA_SENSOR_REGISTER(Lumascope700, REG_GLOBAL_GAIN, 0x35);
+
+#undef ETALUMA_SENSOR_REGISTER
+
+	// Limits and readout geometry per model. Every value except the row
+	// timing below is a copy of the public field of LumaUSB.dll named in
+	// MatchesLibrary, and Initialize refuses to run a camera whose library
+	// disagrees. Both models carry the same sensor, so the library reports
+	// the same values for them.
+	template <class Model> struct SensorTraits;
+
+	struct Lumascope600And700Traits
+	{
+		static constexpr int imageWidth = 1200;
+		static constexpr int imageHeight = 1200;
+		static constexpr int bitDepth = 8;
+		static constexpr unsigned short maxGlobalGain = 222;
+		static constexpr unsigned short recommendedMinGlobalGain = 8;
+		static constexpr int maxExposure = 2000;		// ms, bounds the Exposure property
+
+		// The shutter width register counts rows, not time. A row lasts the
+		// active columns plus the horizontal blanking, in pixel clocks; the
+		// blanking is the sensor's power-up default, which the adapter never
+		// changes.
+		static constexpr int horizontalBlanking = 244;
+
+		// Clock table, slowest first. Descriptions are the clock in MHz.
+		static constexpr int pixelClockCount = 4;
+
+		static const char* PixelClockDescription(int index)
+		{
+			static const char* const table[pixelClockCount] = { "6", "12", "24", "48" };
+			return (index >= 0 && index < pixelClockCount) ? table[index] : "";
+		}
+	};
+
+	template <> struct SensorTraits<Lumascope600> : Lumascope600And700Traits {};
+	template <> struct SensorTraits<Lumascope700> : Lumascope600And700Traits {};
+
+	// Runtime view of a sensor, so the adapter can pick the model from its
+	// pre-initialization property.
+	class SensorModel
+	{
+	public:
+		virtual ~SensorModel() {}
+
+		virtual int ImageWidth() const = 0;
+		virtual int ImageHeight() const = 0;
+		virtual int BitDepth() const = 0;
+		virtual unsigned short MaxGlobalGain() const = 0;
+		virtual unsigned short RecommendedMinGlobalGain() const = 0;
+		virtual int MaxExposure() const = 0;
+		virtual int PixelClockCount() const = 0;
+		virtual const char* PixelClockDescription(int index) const = 0;
+
+		// Duration of one sensor row at the given clock, the unit of the
+		// shutter width register.
+		virtual double RowTimeUs(int clockIndex) const = 0;
+
+		virtual bool WriteExposure(unsigned short value) = 0;
+		virtual bool WriteGlobalGain(unsigned short value) = 0;
+		virtual bool WriteReset(unsigned short value) = 0;
+
+		// Compare the native description with what LumaUSB.dll reports. On a
+		// mismatch, mismatch names the first value that differs. Every getter
+		// is a managed call, so this is for Initialize only.
+		virtual bool MatchesLibrary(ELumaUSB& usb, std::string& mismatch) const = 0;
+	};
+
+	template <class Model>
+	class ImageSensor : public SensorModel
+	{
+	public:
+		typedef SensorTraits<Model> Traits;
+
+		explicit ImageSensor(ELumaUSB& usb) : usb_(usb) {}
+
+		// Typed register access, the address is resolved at compile time.
+		template <Register R>
+		bool Write(unsigned short value)
+		{
+			return usb_.ImageSensorRegisterWrite(RegisterMap<Model, R>::value, value);
+		}
+
+		template <Register R>
+		bool Read(unsigned short& value)
+		{
+			return usb_.ImageSensorRegisterRead(RegisterMap<Model, R>::value, value);
+		}
+
+		int ImageWidth() const { return Traits::imageWidth; }
+		int ImageHeight() const { return Traits::imageHeight; }
+		int BitDepth() const { return Traits::bitDepth; }
+		unsigned short MaxGlobalGain() const { return Traits::maxGlobalGain; }
+		unsigned short RecommendedMinGlobalGain() const { return Traits::recommendedMinGlobalGain; }
+		int MaxExposure() const { return Traits::maxExposure; }
+		int PixelClockCount() const { return Traits::pixelClockCount; }
+		const char* PixelClockDescription(int index) const { return Traits::PixelClockDescription(index); }
+
+		double RowTimeUs(int clockIndex) const
+		{
+			double clockMHz = atof(Traits::PixelClockDescription(clockIndex));
+			return clockMHz > 0 ? (Traits::imageWidth + Traits::horizontalBlanking) / clockMHz : 0;
+		}
+
+		bool WriteExposure(unsigned short value) { return Write<REG_SHUTTER_WIDTH_LOWER>(value); }
+		bool WriteGlobalGain(unsigned short value) { return Write<REG_GLOBAL_GAIN>(value); }
+		bool WriteReset(unsigned short value) { return Write<REG_RESET>(value); }
+
+		bool MatchesLibrary(ELumaUSB& usb, std::string& mismatch) const
+		{
+			struct Check { const char* field; long library; long native; };
+			const Check checks[] = {
+				{ "IMAGE_SENSOR_SHUTTER_WIDTH_LOWER", usb.IMAGE_SENSOR_SHUTTER_WIDTH_LOWER(), RegisterMap<Model, REG_SHUTTER_WIDTH_LOWER>::value },
+				{ "IMAGE_SENSOR_RESET", usb.IMAGE_SENSOR_RESET(), RegisterMap<Model, REG_RESET>::value },
+				{ "IMAGE_SENSOR_GREEN1_GAIN", usb.IMAGE_SENSOR_GREEN1_GAIN(), RegisterMap<Model, REG_GREEN1_GAIN>::value },
+				{ "IMAGE_SENSOR_BLUE_GAIN", usb.IMAGE_SENSOR_BLUE_GAIN(), RegisterMap<Model, REG_BLUE_GAIN>::value },
+				{ "IMAGE_SENSOR_RED_GAIN", usb.IMAGE_SENSOR_RED_GAIN(), RegisterMap<Model, REG_RED_GAIN>::value },
+				{ "IMAGE_SENSOR_GREEN2_GAIN", usb.IMAGE_SENSOR_GREEN2_GAIN(), RegisterMap<Model, REG_GREEN2_GAIN>::value },
+				{ "IMAGE_SENSOR_GLOBAL_GAIN", usb.IMAGE_SENSOR_GLOBAL_GAIN(), RegisterMap<Model, REG_GLOBAL_GAIN>::value },
+				{ "MAX_GLOBAL_GAIN_PARAMETER_VALUE", usb.MAX_GLOBAL_GAIN_PARAMETER_VALUE(), Traits::maxGlobalGain },
+				{ "RECOMMENDED_MIN_GLOBAL_GAIN_PARAMETER_VALUE", usb.RECOMMENDED_MIN_GLOBAL_GAIN_PARAMETER_VALUE(), Traits::recommendedMinGlobalGain },
+				{ "MAX_IMAGE_SENSOR_EXPOSURE", usb.MAX_IMAGE_SENSOR_EXPOSURE(), Traits::maxExposure },
+				{ "GetPixelClockDescriptionCount", usb.GetPixelClockDescriptionCount(), Traits::pixelClockCount }
+			};
+			for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+				if (checks[i].library != checks[i].native) {
+					mismatch = checks[i].field;
+					return false;
+				}
+			}
+
+			for (int i = 0; i < Traits::pixelClockCount; i++) {
+				if (usb.GetPixelClockDescription(i) != Traits::PixelClockDescription(i)) {
+					mismatch = "GetPixelClockDescription";
+					return false;
+				}
+			}
+
+			return true;
+		}
+
+	private:
+		ELumaUSB& usb_;
+	};
+}
+
+#endif //_SENSORMODEL_H_
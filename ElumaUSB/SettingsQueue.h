@@ -0,0 +1,94 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SettingsQueue.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Camera settings changed while a sequence runs. Property
+//				  handlers post them from any thread, and the acquisition
+//				  thread takes them between frames and writes them to the
+//				  device in one go.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _SETTINGSQUEUE_H_
+#define _SETTINGSQUEUE_H_
+
+#include "DeviceThreads.h"
+#include <atomic>
+
+// Only the last value posted for each setting is kept, so a slider drag
+// costs one device write per frame at most.
+class SettingsQueue
+{
+public:
+	enum Setting
+	{
+		SETTING_EXPOSURE,
+		SETTING_GLOBAL_GAIN,
+		SETTING_PIXEL_CLOCK,
+		SETTING_COUNT
+	};
+
+	// Settings taken off the queue together. Only flagged values are set.
+	struct Batch
+	{
+		bool set[SETTING_COUNT];
+		unsigned short value[SETTING_COUNT];
+	};
+
+	SettingsQueue() : pending_(false)
+	{
+		Clear(batch_);
+	}
+
+	// Any thread. Replaces a value of the same setting not taken yet.
+	void Post(Setting setting, unsigned short value)
+	{
+		MMThreadGuard g(lock_);
+		batch_.set[setting] = true;
+		batch_.value[setting] = value;
+		pending_.store(true, std::memory_order_release);
+	}
+
+	// Acquisition thread. Takes everything posted so far, returns false if
+	// there was nothing. Costs no lock while the queue is empty.
+	bool Take(Batch& batch)
+	{
+		if (!pending_.load(std::memory_order_acquire))
+			return false;
+
+		MMThreadGuard g(lock_);
+		batch = batch_;
+		Clear(batch_);
+		pending_.store(false, std::memory_order_relaxed);
+		return true;
+	}
+
+private:
+	static void Clear(Batch& batch)
+	{
+		for (int i = 0; i < SETTING_COUNT; i++) {
+			batch.set[i] = false;
+			batch.value[i] = 0;
+		}
+	}
+
+	MMThreadLock lock_;
+	Batch batch_;
+	std::atomic<bool> pending_;
+};
+
+#endif //_SETTINGSQUEUE_H_
@@ -0,0 +1,257 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SharedFrameReader.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Reader of the shared memory frame ring of the Etaluma
+//				  adapter, for processes that want frames without going
+//				  through Micro-Manager. Header only, include it together
+//				  with SharedFrameRing.h and nothing else from the adapter.
+//
+//				  SharedFrameReader reader;
+//				  reader.Open("EtalumaFrames");
+//				  SharedFrameReader::Frame frame;
+//				  while (!reader.WriterClosed()) {
+//				      if (!reader.Next(frame)) { sleep; continue; }
+//				      process(frame.pixels, frame.slot->width, ...);
+//				      if (!reader.Valid(frame)) discard the result;
+//				  }
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _SHAREDFRAMEREADER_H_
+#define _SHAREDFRAMEREADER_H_
+
+#include "SharedFrameRing.h"
+#include <cstring>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+class SharedFrameReader
+{
+public:
+	// A frame in place in the ring. pixels stay mapped, but the writer may
+	// overwrite them once it laps the reader, see Valid.
+	struct Frame
+	{
+		const SharedFrameRing::SlotHeader* slot;
+		const unsigned char* pixels;
+		uint64_t index;
+		uint64_t sequence;
+	};
+
+	SharedFrameReader() :
+		header_(0), data_(0), size_(0), mapping_(0), fd_(-1), slotCount_(0), slotBytes_(0), slotOffset_(0),
+		generation_(0), next_(0), read_(0), missed_(0)
+	{
+	}
+
+	~SharedFrameReader() { Close(); }
+
+	// Map the ring read-only. Only frames published from now on are seen.
+	// Fails while the writer is still setting the ring up.
+	bool Open(const std::string& name)
+	{
+		Close();
+#ifdef _WIN32
+		HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+		if (mapping == NULL)
+			return false;
+		void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		MEMORY_BASIC_INFORMATION region;
+		if (data == NULL || VirtualQuery(data, &region, sizeof(region)) == 0) {
+			if (data != NULL)
+				UnmapViewOfFile(data);
+			CloseHandle(mapping);
+			return false;
+		}
+		mapping_ = mapping;
+		size_ = region.RegionSize;
+#else
+		std::string path = (name[0] == '/') ? name : "/" + name;
+		int fd = shm_open(path.c_str(), O_RDONLY, 0);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		void* data = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+			data = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			close(fd);
+			return false;
+		}
+		fd_ = fd;
+		size_ = (size_t)st.st_size;
+#endif
+		data_ = static_cast<const unsigned char*>(data);
+		header_ = reinterpret_cast<const SharedFrameRing::RingHeader*>(data_);
+
+		if (size_ < SharedFrameRing::SLOT_HEADER_BYTES) {
+			Close();
+			return false;
+		}
+
+		// The layout is kept, as the writer may set up the mapping again
+		// with another one, see Current.
+		generation_ = header_->generation.load(std::memory_order_acquire);
+		slotCount_ = header_->slotCount;
+		slotBytes_ = header_->slotBytes;
+		slotOffset_ = header_->slotOffset;
+		bool valid = header_->magic == SharedFrameRing::MAGIC && header_->version == SharedFrameRing::VERSION &&
+			slotCount_ > 0 && slotBytes_ > SharedFrameRing::SLOT_HEADER_BYTES &&
+			slotOffset_ + slotCount_ * slotBytes_ <= size_;
+		next_ = header_->published.load(std::memory_order_acquire);
+		if (generation_ == 0 || (generation_ & 1) != 0 || !valid || !Current()) {
+			Close();
+			return false;
+		}
+
+		read_ = 0;
+		missed_ = 0;
+		return true;
+	}
+
+	void Close()
+	{
+		if (data_ == 0)
+			return;
+#ifdef _WIN32
+		UnmapViewOfFile(data_);
+		CloseHandle((HANDLE)mapping_);
+		mapping_ = 0;
+#else
+		munmap(const_cast<unsigned char*>(data_), size_);
+		close(fd_);
+		fd_ = -1;
+#endif
+		data_ = 0;
+		header_ = 0;
+		size_ = 0;
+		generation_ = 0;
+	}
+
+	bool IsOpen() const { return data_ != 0; }
+
+	// The writer closed or replaced the ring, Open it again to follow.
+	bool WriterClosed() const
+	{
+		return header_ == 0 || header_->closed.load(std::memory_order_acquire) != 0 || !Current();
+	}
+
+	// The oldest frame not seen yet, in place. Returns false if there is
+	// none. Frames the writer overwrote before the reader got to them are
+	// skipped and counted in FramesMissed.
+	bool Next(Frame& frame)
+	{
+		if (header_ == 0 || !Current())
+			return false;
+
+		const uint64_t slots = slotCount_;
+		for (;;) {
+			uint64_t published = header_->published.load(std::memory_order_acquire);
+			if (next_ == published)
+				return false;
+
+			// The slot of frame published - slots is being refilled.
+			if (published - next_ >= slots) {
+				missed_ += published - next_ - (slots - 1);
+				next_ = published - (slots - 1);
+			}
+
+			const unsigned char* base = data_ + slotOffset_ + (next_ % slots) * slotBytes_;
+			const SharedFrameRing::SlotHeader* slot = reinterpret_cast<const SharedFrameRing::SlotHeader*>(base);
+			uint64_t sequence = slot->sequence.load(std::memory_order_acquire);
+
+			// published or the slot may already belong to a new ring.
+			if (!Current())
+				return false;
+			if (sequence != 2 * next_ + 2) {
+				// Overwritten since published was read, look again.
+				missed_++;
+				next_++;
+				continue;
+			}
+
+			frame.slot = slot;
+			frame.pixels = base + SharedFrameRing::SLOT_HEADER_BYTES;
+			frame.index = next_;
+			frame.sequence = sequence;
+			next_++;
+			read_++;
+			return true;
+		}
+	}
+
+	// True if nothing of frame was overwritten since Next returned it. Call
+	// after using the frame in place, and drop the result if it fails.
+	bool Valid(const Frame& frame) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return frame.slot->sequence.load(std::memory_order_relaxed) == frame.sequence &&
+			header_->generation.load(std::memory_order_relaxed) == generation_;
+	}
+
+	// Copy the pixels of frame into dst. Returns false if the frame was
+	// overwritten while copying.
+	bool Copy(const Frame& frame, unsigned char* dst) const
+	{
+		size_t bytes = frame.slot->pixelBytes;
+		if (bytes > slotBytes_ - SharedFrameRing::SLOT_HEADER_BYTES)
+			bytes = (size_t)(slotBytes_ - SharedFrameRing::SLOT_HEADER_BYTES);
+		memcpy(dst, frame.pixels, bytes);
+		return Valid(frame);
+	}
+
+	unsigned long long FramesRead() const { return read_; }
+	unsigned long long FramesMissed() const { return missed_; }
+
+private:
+	SharedFrameReader(const SharedFrameReader&);
+	SharedFrameReader& operator=(const SharedFrameReader&);
+
+	// Still the ring that was opened. Loads before this one are ordered
+	// before it, so anything they saw of a newer ring shows up here.
+	bool Current() const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return header_->generation.load(std::memory_order_relaxed) == generation_;
+	}
+
+	const SharedFrameRing::RingHeader* header_;
+	const unsigned char* data_;
+	size_t size_;
+	void* mapping_;
+	int fd_;
+	uint64_t slotCount_;
+	uint64_t slotBytes_;
+	uint64_t slotOffset_;
+	uint32_t generation_;
+	uint64_t next_;
+	unsigned long long read_;
+	unsigned long long missed_;
+};
+
+#endif //_SHAREDFRAMEREADER_H_
@@ -0,0 +1,221 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SharedFrameRing.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Writer side of the shared memory frame ring.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "SharedFrameRing.h"
+#include "FrameQueue.h"
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace SharedFrameRing;
+
+static_assert(sizeof(RingHeader) <= SLOT_HEADER_BYTES, "ring header does not fit");
+static_assert(sizeof(SlotHeader) <= SLOT_HEADER_BYTES, "slot header does not fit");
+
+SharedFrameWriter::SharedFrameWriter() :
+	slots_(0),
+	frameBytes_(0),
+	data_(0),
+	size_(0),
+	mapping_(0),
+	fd_(-1),
+	next_(0),
+	published_(0),
+	bytes_(0),
+	firstUs_(0),
+	lastUs_(0)
+{
+}
+
+SharedFrameWriter::~SharedFrameWriter()
+{
+	Close();
+}
+
+bool SharedFrameWriter::Open(const string& name, unsigned slots, size_t frameBytes)
+{
+	Close();
+	if (name.empty() || slots == 0)
+		return false;
+
+	// Keep pixel rows of every slot cache line aligned.
+	frameBytes = (frameBytes + 63) & ~(size_t)63;
+	size_t size = MappingBytes(slots, frameBytes);
+
+#ifdef _WIN32
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+		(DWORD)((unsigned long long)size >> 32), (DWORD)(size & 0xFFFFFFFF), name.c_str());
+	if (mapping == NULL)
+		return false;
+
+	// If a reader still holds a ring of the same name, CreateFileMappingA
+	// returns that mapping instead of a new one. It is reused if it is large
+	// enough, and the new generation below tells its readers it was closed.
+	void* data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION region;
+	if (data == NULL || VirtualQuery(data, &region, sizeof(region)) == 0 || region.RegionSize < size) {
+		if (data != NULL)
+			UnmapViewOfFile(data);
+		CloseHandle(mapping);
+		return false;
+	}
+	mapping_ = mapping;
+#else
+	// Readers of a previous ring keep their mapping of the unlinked object.
+	string path = (name[0] == '/') ? name : "/" + name;
+	shm_unlink(path.c_str());
+	int fd = shm_open(path.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0)
+		return false;
+
+	void* data = MAP_FAILED;
+	if (ftruncate(fd, (off_t)size) == 0)
+		data = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		shm_unlink(path.c_str());
+		return false;
+	}
+	fd_ = fd;
+#endif
+
+	data_ = static_cast<unsigned char*>(data);
+	size_ = size;
+	name_ = name;
+	slots_ = slots;
+	frameBytes_ = frameBytes;
+	next_ = 0;
+
+	// Mark the ring as being set up before touching anything else. A new
+	// mapping is all zeros and starts at generation 1.
+	RingHeader* header = reinterpret_cast<RingHeader*>(data_);
+	uint32_t previous = (header->magic == MAGIC && header->version == VERSION) ?
+		header->generation.load(memory_order_relaxed) : 0;
+	uint32_t generation = (previous & 1) ? previous + 2 : previous + 1;
+	header->generation.store(generation, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	for (unsigned i = 0; i < slots; i++) {
+		SlotHeader* slot = reinterpret_cast<SlotHeader*>(data_ + SLOT_HEADER_BYTES + i * (SLOT_HEADER_BYTES + frameBytes));
+		slot->sequence.store(0, memory_order_relaxed);
+	}
+
+	header->slotCount = slots;
+	header->slotBytes = SLOT_HEADER_BYTES + frameBytes;
+	header->slotOffset = SLOT_HEADER_BYTES;
+	header->published.store(0, memory_order_relaxed);
+	header->closed.store(0, memory_order_relaxed);
+	header->version = VERSION;
+	header->magic = MAGIC;
+
+	// Skip 0 on wrap around, a reader takes it for a ring not set up yet.
+	generation++;
+	if (generation == 0)
+		generation = 2;
+	header->generation.store(generation, memory_order_release);
+
+	ResetCounters();
+	return true;
+}
+
+void SharedFrameWriter::Close()
+{
+	if (data_ == 0)
+		return;
+
+	reinterpret_cast<RingHeader*>(data_)->closed.store(1, memory_order_release);
+
+#ifdef _WIN32
+	UnmapViewOfFile(data_);
+	CloseHandle((HANDLE)mapping_);
+	mapping_ = 0;
+#else
+	munmap(data_, size_);
+	close(fd_);
+	fd_ = -1;
+	shm_unlink(((name_[0] == '/') ? name_ : "/" + name_).c_str());
+#endif
+
+	data_ = 0;
+	size_ = 0;
+	name_.clear();
+}
+
+bool SharedFrameWriter::Publish(const unsigned char* pixels, unsigned width, unsigned height, unsigned bytesPerPixel,
+	const FrameInfo& info)
+{
+	size_t bytes = (size_t)width * height * bytesPerPixel;
+	if (data_ == 0 || bytes > frameBytes_)
+		return false;
+
+	RingHeader* header = reinterpret_cast<RingHeader*>(data_);
+	unsigned char* base = data_ + header->slotOffset + (next_ % slots_) * header->slotBytes;
+	SlotHeader* slot = reinterpret_cast<SlotHeader*>(base);
+
+	// Mark the slot as being written before touching its contents.
+	slot->sequence.store(2 * next_ + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	slot->info = info;
+	slot->width = width;
+	slot->height = height;
+	slot->bytesPerPixel = bytesPerPixel;
+	slot->pixelBytes = (uint32_t)bytes;
+	memcpy(base + SLOT_HEADER_BYTES, pixels, bytes);
+
+	slot->sequence.store(2 * next_ + 2, memory_order_release);
+	next_++;
+	header->published.store(next_, memory_order_release);
+
+	double now = FrameQueue::Now();
+	if (published_.load(memory_order_relaxed) == 0)
+		firstUs_.store(now, memory_order_relaxed);
+	lastUs_.store(now, memory_order_relaxed);
+	bytes_.fetch_add(bytes, memory_order_relaxed);
+	published_.fetch_add(1, memory_order_relaxed);
+	return true;
+}
+
+void SharedFrameWriter::ResetCounters()
+{
+	published_.store(0, memory_order_relaxed);
+	bytes_.store(0, memory_order_relaxed);
+	firstUs_.store(0, memory_order_relaxed);
+	lastUs_.store(0, memory_order_relaxed);
+}
+
+// Pixel data published per second, between the first and the last frame.
+double SharedFrameWriter::ThroughputMBps() const
+{
+	double elapsedUs = lastUs_.load(memory_order_relaxed) - firstUs_.load(memory_order_relaxed);
+	if (elapsedUs <= 0)
+		return 0;
+	return bytes_.load(memory_order_relaxed) / elapsedUs;
+}
@@ -0,0 +1,140 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          SharedFrameRing.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Ring of frames in named shared memory, written by the
+//				  acquisition thread of the Etaluma adapter so that local
+//				  processes can map the frames as they arrive instead of
+//				  receiving copies through Micro-Manager. This header holds
+//				  the memory layout shared with the readers and the writer.
+//				  Readers use SharedFrameReader.h.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _SHAREDFRAMERING_H_
+#define _SHAREDFRAMERING_H_
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <stdint.h>
+
+/**
+* Layout of the mapping: a RingHeader, then slotCount slots of slotBytes
+* each, starting at slotOffset. A slot is a SlotHeader followed by the
+* pixels at SLOT_HEADER_BYTES.
+*
+* Frame n of the ring goes to slot n % slotCount. Its slot sequence is
+* 2n + 1 while the writer fills it and 2n + 2 once it is complete, so a
+* reader knows frame n is intact if it sees 2n + 2 both before and after
+* looking at the slot. The writer never waits for readers.
+*
+* A writer may reinitialise a mapping that readers still hold, which is
+* what happens on Windows when the ring is reopened under the same name.
+* generation is odd while the writer sets the ring up and even, never 0,
+* once it is ready. It changes with every Open, so readers remember the one
+* they opened and treat any other as the ring being closed.
+*/
+namespace SharedFrameRing
+{
+	const uint32_t MAGIC = 0x52464C45;	// "ELFR"
+	const uint32_t VERSION = 2;
+	const size_t SLOT_HEADER_BYTES = 128;
+
+	struct RingHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slotCount;
+		std::atomic<uint32_t> generation;
+		uint64_t slotBytes;
+		uint64_t slotOffset;
+		std::atomic<uint64_t> published;	// frames completed so far
+		std::atomic<uint32_t> closed;		// set when the writer goes away
+	};
+
+	// Per frame metadata, filled by the writer.
+	struct FrameInfo
+	{
+		uint64_t frameNumber;	// USB frame number
+		uint64_t imageNumber;	// image index within the sequence
+		double timestampUs;		// arrival time, FrameQueue::Now()
+		int32_t ledChannel;		// -1 without an LED sequence
+		uint32_t ledBrightness;
+	};
+
+	struct SlotHeader
+	{
+		std::atomic<uint64_t> sequence;
+		FrameInfo info;
+		uint32_t width;
+		uint32_t height;
+		uint32_t bytesPerPixel;
+		uint32_t pixelBytes;
+	};
+
+	inline size_t MappingBytes(uint32_t slotCount, size_t frameBytes)
+	{
+		return SLOT_HEADER_BYTES + (size_t)slotCount * (SLOT_HEADER_BYTES + frameBytes);
+	}
+}
+
+class SharedFrameWriter
+{
+public:
+	SharedFrameWriter();
+	~SharedFrameWriter();
+
+	// Create the named ring with slots frames of up to frameBytes each,
+	// replacing a ring of the same name. Readers of a replaced ring see it
+	// closed.
+	bool Open(const std::string& name, unsigned slots, size_t frameBytes);
+	void Close();
+
+	bool IsOpen() const { return data_ != 0; }
+	const std::string& Name() const { return name_; }
+	unsigned Slots() const { return slots_; }
+	size_t FrameBytes() const { return frameBytes_; }
+
+	// Copy one frame into the next slot. Returns false if it does not fit.
+	bool Publish(const unsigned char* pixels, unsigned width, unsigned height, unsigned bytesPerPixel,
+		const SharedFrameRing::FrameInfo& info);
+
+	// Counters since Open or ResetCounters, safe to read from any thread.
+	void ResetCounters();
+	unsigned long long Published() const { return published_.load(std::memory_order_relaxed); }
+	double ThroughputMBps() const;
+
+private:
+	SharedFrameWriter(const SharedFrameWriter&);
+	SharedFrameWriter& operator=(const SharedFrameWriter&);
+
+	std::string name_;
+	unsigned slots_;
+	size_t frameBytes_;
+	unsigned char* data_;
+	size_t size_;
+	void* mapping_;		// file mapping handle on Windows
+	int fd_;			// shared memory object elsewhere
+	uint64_t next_;
+	std::atomic<unsigned long long> published_;
+	std::atomic<unsigned long long> bytes_;
+	std::atomic<double> firstUs_;
+	std::atomic<double> lastUs_;
+};
+
+#endif //_SHAREDFRAMERING_H_
@@ -0,0 +1,329 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StreamFile.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Capture and replay of the Etaluma frame stream.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "StreamFile.h"
+#include "FrameQueue.h"
+#include "DeviceUtils.h"
+#include <cstring>
+#include <thread>
+
+using namespace std;
+using namespace StreamFile;
+
+const char g_StreamMagic[8] = { 'E', 'T', 'L', 'S', 'T', 'R', '0', '1' };
+
+// How long the capture writer holds back controls while no frame is queued,
+// since a frame stamped before them may still be on its way.
+const double g_ControlHoldUs = 100000.0;
+
+///////////////////////////////////////////////////////////////////////////////
+// StreamCapture
+///////////////////////////////////////////////////////////////////////////////
+
+StreamCapture::StreamCapture() :
+	file_(0),
+	frameBytes_(0),
+	writer_(this),
+	capturing_(false),
+	inFrame_(false),
+	closing_(false),
+	failed_(false),
+	dropped_(0)
+{
+}
+
+StreamCapture::~StreamCapture()
+{
+	Close();
+}
+
+bool StreamCapture::Open(const string& path, unsigned width, unsigned height)
+{
+	Close();
+
+	file_ = fopen(path.c_str(), "wb");
+	if (file_ == 0)
+		return false;
+
+	unsigned int header[2] = { width, height };
+	if (fwrite(g_StreamMagic, sizeof(g_StreamMagic), 1, file_) != 1 || fwrite(header, sizeof(header), 1, file_) != 1) {
+		fclose(file_);
+		file_ = 0;
+		return false;
+	}
+
+	frameBytes_ = (size_t)width * height * 3;
+	pool_.assign(QUEUE_FRAMES, vector<unsigned char>(frameBytes_));
+	frames_.Allocate(QUEUE_FRAMES);
+	free_.Allocate(QUEUE_FRAMES);
+	for (int i = 0; i < (int)QUEUE_FRAMES; i++)
+		free_.TryPush(i);
+	controls_.clear();
+	writing_.clear();
+
+	closing_.store(false);
+	failed_.store(false);
+	dropped_.store(0);
+	writer_.activate();
+	capturing_.store(true, memory_order_release);
+	return true;
+}
+
+void StreamCapture::Close()
+{
+	if (file_ == 0)
+		return;
+
+	// Once capturing_ is down, a transport thread that still saw it up is
+	// the only user of the pool, and it says so through inFrame_.
+	capturing_.store(false, memory_order_seq_cst);
+	while (inFrame_.load(memory_order_seq_cst))
+		this_thread::yield();
+
+	closing_.store(true, memory_order_release);
+	writer_.wait();
+
+	MMThreadGuard g(controlLock_);
+	fclose(file_);
+	file_ = 0;
+	controls_.clear();
+}
+
+void StreamCapture::WriteFrame(double timestampUs, const unsigned char* data, int length)
+{
+	inFrame_.store(true, memory_order_seq_cst);
+	if (capturing_.load(memory_order_seq_cst) && !failed_.load(memory_order_relaxed)) {
+		FrameSlot slot;
+		if (length < 0 || (size_t)length > frameBytes_ || !free_.TryPop(slot.buffer)) {
+			dropped_.fetch_add(1, memory_order_relaxed);
+		}
+		else {
+			memcpy(&pool_[slot.buffer][0], data, (size_t)length);
+			slot.length = (unsigned int)length;
+			slot.timestampUs = timestampUs;
+			frames_.TryPush(slot);
+		}
+	}
+	inFrame_.store(false, memory_order_release);
+}
+
+void StreamCapture::WriteControl(RecordType type, unsigned short a, unsigned short b, double timestampUs)
+{
+	if (!IsOpen())
+		return;
+
+	Control control;
+	control.type = type;
+	control.args[0] = a;
+	control.args[1] = b;
+	control.timestampUs = timestampUs;
+
+	MMThreadGuard g(controlLock_);
+	if (file_ != 0)
+		controls_.push_back(control);
+}
+
+// Frames and controls are written in timestamp order: before each frame,
+// the controls made up to its arrival.
+int StreamCapture::WriteLoop()
+{
+	for (;;) {
+		FrameSlot slot;
+		if (!frames_.TryPop(slot)) {
+			bool closing = closing_.load(memory_order_acquire);
+			if (closing && frames_.Size() == 0) {
+				WriteControls(-1);
+				break;
+			}
+			WriteControls(FrameQueue::Now() - g_ControlHoldUs);
+			CDeviceUtils::SleepMs(1);
+			continue;
+		}
+
+		WriteControls(slot.timestampUs);
+		WriteRecord(RECORD_FRAME, slot.timestampUs, &pool_[slot.buffer][0], slot.length);
+		free_.TryPush(slot.buffer);
+	}
+
+	return 0;
+}
+
+// Write the queued controls made before beforeUs, or all of them if it is
+// negative.
+void StreamCapture::WriteControls(double beforeUs)
+{
+	{
+		MMThreadGuard g(controlLock_);
+		writing_.insert(writing_.end(), controls_.begin(), controls_.end());
+		controls_.clear();
+	}
+
+	size_t n = 0;
+	while (n < writing_.size() && (beforeUs < 0 || writing_[n].timestampUs <= beforeUs)) {
+		WriteRecord(writing_[n].type, writing_[n].timestampUs, writing_[n].args, sizeof(writing_[n].args));
+		n++;
+	}
+	writing_.erase(writing_.begin(), writing_.begin() + n);
+}
+
+// A failed write stops the capture rather than leaving a file with a
+// truncated record in the middle. The file stays open until Close.
+void StreamCapture::WriteRecord(RecordType type, double timestampUs, const void* payload, unsigned int length)
+{
+	if (failed_.load(memory_order_relaxed))
+		return;
+
+	RecordHeader header;
+	memset(&header, 0, sizeof(header));
+	header.type = (unsigned char)type;
+	header.length = length;
+	header.timestampUs = timestampUs;
+
+	if (fwrite(&header, sizeof(header), 1, file_) != 1 ||
+		(length > 0 && fwrite(payload, 1, length, file_) != length)) {
+		failed_.store(true, memory_order_relaxed);
+	}
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// StreamReplay
+///////////////////////////////////////////////////////////////////////////////
+
+StreamReplay::StreamReplay() :
+	file_(0),
+	dataStart_(0),
+	width_(0),
+	height_(0),
+	realTime_(true),
+	havePending_(false),
+	wallStartUs_(0),
+	streamStartUs_(-1),
+	framesThisPass_(0)
+{
+}
+
+StreamReplay::~StreamReplay()
+{
+	Close();
+}
+
+bool StreamReplay::Open(const string& path)
+{
+	Close();
+
+	file_ = fopen(path.c_str(), "rb");
+	if (file_ == 0)
+		return false;
+
+	char magic[8];
+	unsigned int header[2];
+	if (fread(magic, sizeof(magic), 1, file_) != 1 || memcmp(magic, g_StreamMagic, sizeof(magic)) != 0 ||
+		fread(header, sizeof(header), 1, file_) != 1) {
+		Close();
+		return false;
+	}
+
+	width_ = header[0];
+	height_ = header[1];
+	dataStart_ = ftell(file_);
+	Rewind();
+	return true;
+}
+
+void StreamReplay::Close()
+{
+	if (file_ != 0) {
+		fclose(file_);
+		file_ = 0;
+	}
+}
+
+void StreamReplay::Rewind()
+{
+	if (file_ != 0)
+		fseek(file_, dataStart_, SEEK_SET);
+	havePending_ = false;
+	streamStartUs_ = -1;
+	framesThisPass_ = 0;
+}
+
+bool StreamReplay::ReadHeader()
+{
+	if (fread(&pending_, sizeof(pending_), 1, file_) == 1) {
+		havePending_ = true;
+		return true;
+	}
+
+	// Start over at the end of the file, unless the last pass found nothing
+	// to deliver.
+	if (framesThisPass_ == 0)
+		return false;
+	Rewind();
+	if (fread(&pending_, sizeof(pending_), 1, file_) != 1)
+		return false;
+	havePending_ = true;
+	return true;
+}
+
+// Pace frames by their captured timestamps, relative to the first frame of
+// the current pass.
+bool StreamReplay::Due(double timestampUs)
+{
+	if (!realTime_.load(memory_order_relaxed))
+		return true;
+
+	if (streamStartUs_ < 0) {
+		streamStartUs_ = timestampUs;
+		wallStartUs_ = FrameQueue::Now();
+		return true;
+	}
+
+	return FrameQueue::Now() - wallStartUs_ >= timestampUs - streamStartUs_;
+}
+
+bool StreamReplay::ReadFrame(unsigned char* buffer, int* count)
+{
+	if (file_ == 0)
+		return false;
+
+	for (;;) {
+		if (!havePending_ && !ReadHeader())
+			return false;
+
+		if (pending_.type != RECORD_FRAME || pending_.length > (unsigned int)*count) {
+			fseek(file_, pending_.length, SEEK_CUR);
+			havePending_ = false;
+			continue;
+		}
+
+		if (!Due(pending_.timestampUs))
+			return false;
+
+		havePending_ = false;
+		if (fread(buffer, 1, pending_.length, file_) != pending_.length)
+			continue;
+
+		*count = (int)pending_.length;
+		framesThisPass_++;
+		return true;
+	}
+}
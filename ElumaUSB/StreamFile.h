@@ -0,0 +1,189 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StreamFile.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Capture and replay of the Etaluma frame stream, so that an
+//				  acquisition can be reproduced and the adapter pipeline
+//				  profiled without the microscope attached.
+//
+//				  LumaUSB.dll reassembles the isochronous packets internally
+//				  and only hands out complete frames, so the stream is
+//				  captured at that level: every buffer LumaUSB delivered,
+//				  torn ones included, together with the control writes
+//				  that were made while capturing.
+//
+//				  File layout, all values little endian:
+//				    header   "ETLSTR01", uint32 width, uint32 height
+//				    records  uint8 type, uint8 reserved[3], uint32 length,
+//				             double timestampUs, payload[length]
+//				  Frame records carry the 24bpp buffer as payload, control
+//				  records two uint16 arguments.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _STREAMFILE_H_
+#define _STREAMFILE_H_
+
+#include "DeviceThreads.h"
+#include "FrameQueue.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <atomic>
+
+namespace StreamFile
+{
+	enum RecordType
+	{
+		RECORD_FRAME = 0,
+		RECORD_STREAM_START = 1,
+		RECORD_STREAM_STOP = 2,
+		RECORD_EXPOSURE = 3,		// shutter width register value
+		RECORD_GLOBAL_GAIN = 4,
+		RECORD_PIXEL_CLOCK = 5,		// clock index
+		RECORD_LED = 6				// LED id, brightness
+	};
+
+	struct RecordHeader
+	{
+		unsigned char type;
+		unsigned char reserved[3];
+		unsigned int length;
+		double timestampUs;
+	};
+}
+
+// Writes a stream file from a writer thread of its own. Frames come from
+// the transport thread, which must never wait, so they are copied into a
+// small pool and handed over through a lock-free ring; when the writer falls
+// behind they are dropped and counted. Control writes come from whichever
+// thread makes them and are rare, so they are queued under a lock.
+class StreamCapture
+{
+public:
+	// Frames the pool holds while the disk catches up.
+	static const size_t QUEUE_FRAMES = 8;
+
+	StreamCapture();
+	~StreamCapture();
+
+	bool Open(const std::string& path, unsigned width, unsigned height);
+
+	// Write out everything queued and close the file.
+	void Close();
+
+	bool IsOpen() const { return capturing_.load(std::memory_order_acquire); }
+
+	// Both are no-ops while no file is open. WriteFrame is for the transport
+	// thread only and takes no lock.
+	void WriteFrame(double timestampUs, const unsigned char* data, int length);
+	void WriteControl(StreamFile::RecordType type, unsigned short a, unsigned short b, double timestampUs);
+
+	unsigned long long FramesDropped() const { return dropped_.load(std::memory_order_relaxed); }
+	bool Failed() const { return failed_.load(std::memory_order_relaxed); }
+
+private:
+	struct FrameSlot
+	{
+		int buffer;
+		unsigned int length;
+		double timestampUs;
+	};
+
+	struct Control
+	{
+		StreamFile::RecordType type;
+		unsigned short args[2];
+		double timestampUs;
+	};
+
+	class WriterThread : public MMDeviceThreadBase
+	{
+	public:
+		WriterThread(StreamCapture* capture) : capture_(capture) {}
+		int svc(void) throw() { return capture_->WriteLoop(); }
+	private:
+		StreamCapture* capture_;
+	};
+
+	int WriteLoop();
+	void WriteControls(double beforeUs);
+	void WriteRecord(StreamFile::RecordType type, double timestampUs, const void* payload, unsigned int length);
+
+	FILE* file_;
+	size_t frameBytes_;
+	std::vector<std::vector<unsigned char> > pool_;
+	SpscRing<FrameSlot> frames_;	// transport thread to writer
+	SpscRing<int> free_;			// writer to transport thread
+	MMThreadLock controlLock_;
+	std::vector<Control> controls_;	// queued under controlLock_
+	std::vector<Control> writing_;	// writer side, taken from controls_
+	WriterThread writer_;
+	std::atomic<bool> capturing_;
+	std::atomic<bool> inFrame_;		// the transport thread is in WriteFrame
+	std::atomic<bool> closing_;
+	std::atomic<bool> failed_;
+	std::atomic<unsigned long long> dropped_;
+};
+
+// Reads a stream file back for the transport thread. Control records are
+// skipped, since there is no hardware to apply them to. At the end of the
+// file the replay starts over.
+class StreamReplay
+{
+public:
+	StreamReplay();
+	~StreamReplay();
+
+	bool Open(const std::string& path);
+	void Close();
+	bool IsOpen() const { return file_ != 0; }
+
+	unsigned Width() const { return width_; }
+	unsigned Height() const { return height_; }
+
+	// Replay at the captured frame rate, or as fast as the pipeline takes
+	// the frames.
+	void SetRealTime(bool realTime) { realTime_.store(realTime); }
+	bool GetRealTime() const { return realTime_.load(); }
+
+	// Go back to the first record. Called before each stream start, so that
+	// every acquisition sees the same frames in the same order.
+	void Rewind();
+
+	// Same contract as ELumaUSB::GetLatest24bppBuffer: count is the buffer
+	// capacity on entry and the frame size on return. Returns false when no
+	// frame is due yet.
+	bool ReadFrame(unsigned char* buffer, int* count);
+
+private:
+	bool ReadHeader();
+	bool Due(double timestampUs);
+
+	FILE* file_;
+	long dataStart_;
+	unsigned width_;
+	unsigned height_;
+	std::atomic<bool> realTime_;
+	StreamFile::RecordHeader pending_;
+	bool havePending_;
+	double wallStartUs_;
+	double streamStartUs_;
+	unsigned long long framesThisPass_;
+};
+
+#endif //_STREAMFILE_H_
@@ -0,0 +1,46 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          StripConsumer.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Interface for native code that wants each converted frame
+//				  of the Etaluma adapter in bands of rows, as soon as a band
+//				  is final, rather than waiting for the whole image.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _STRIPCONSUMER_H_
+#define _STRIPCONSUMER_H_
+
+// Called on the thread converting the frame, which waits for the consumer,
+// so both methods should return quickly. Strips of a frame arrive in order
+// from the top.
+class StripConsumer
+{
+public:
+	virtual ~StripConsumer() {}
+
+	// Rows firstRow to firstRow + rows - 1 of the width x height 8 bit
+	// image converted from USB frame frameNumber are final. pixels points
+	// at row firstRow and is only valid during the call.
+	virtual void OnStrip(unsigned long long frameNumber, const unsigned char* pixels,
+		unsigned width, unsigned height, unsigned firstRow, unsigned rows) = 0;
+
+	// Every strip of the frame was delivered.
+	virtual void OnFrameEnd(unsigned long long /*frameNumber*/) {}
+};
+
+#endif //_STRIPCONSUMER_H_
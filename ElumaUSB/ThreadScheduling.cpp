@@ -0,0 +1,141 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ThreadScheduling.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   CPU affinity, scheduling priority and NUMA placement for
+//				  the acquisition threads of the Etaluma adapter.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "ThreadScheduling.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+namespace ThreadScheduling
+{
+#ifdef _WIN32
+
+	bool ConfigureCurrentThread(int cpu, Priority priority)
+	{
+		bool ok = true;
+		HANDLE thread = GetCurrentThread();
+
+		if (cpu >= 0 && cpu < (int)(8 * sizeof(DWORD_PTR)))
+			ok = SetThreadAffinityMask(thread, (DWORD_PTR)1 << cpu) != 0;
+
+		int winPriority = THREAD_PRIORITY_NORMAL;
+		switch (priority)
+		{
+		case PRIORITY_ABOVE_NORMAL:
+			winPriority = THREAD_PRIORITY_ABOVE_NORMAL;
+			break;
+		case PRIORITY_HIGHEST:
+			winPriority = THREAD_PRIORITY_HIGHEST;
+			break;
+		case PRIORITY_TIME_CRITICAL:
+			winPriority = THREAD_PRIORITY_TIME_CRITICAL;
+			break;
+		default:
+			break;
+		}
+
+		return SetThreadPriority(thread, winPriority) != 0 && ok;
+	}
+
+	int NumaNodeOfCpu(int cpu)
+	{
+		if (cpu < 0 || cpu > 255)
+			return -1;
+
+		UCHAR node;
+		if (!GetNumaProcessorNode((UCHAR)cpu, &node) || node == 0xFF)
+			return -1;
+		return node;
+	}
+
+	void* AllocateBuffer(size_t bytes, int node)
+	{
+		if (node >= 0) {
+			void* buffer = VirtualAllocExNuma(GetCurrentProcess(), NULL, bytes,
+				MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, (DWORD)node);
+			if (buffer != NULL)
+				return buffer;
+		}
+		return VirtualAlloc(NULL, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+	}
+
+	void FreeBuffer(void* buffer, size_t)
+	{
+		if (buffer != NULL)
+			VirtualFree(buffer, 0, MEM_RELEASE);
+	}
+
+#else
+
+	bool ConfigureCurrentThread(int cpu, Priority priority)
+	{
+		bool ok = true;
+
+#ifdef __linux__
+		if (cpu >= 0 && cpu < CPU_SETSIZE) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			ok = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+		}
+#endif
+
+		// Anything above normal maps onto the round-robin real-time class,
+		// which usually needs elevated rights.
+		if (priority != PRIORITY_NORMAL) {
+			sched_param param;
+			int low = sched_get_priority_min(SCHED_RR);
+			int high = sched_get_priority_max(SCHED_RR);
+			param.sched_priority = low + (high - low) * (int)priority / (int)PRIORITY_TIME_CRITICAL;
+			ok = pthread_setschedparam(pthread_self(), SCHED_RR, &param) == 0 && ok;
+		}
+
+		return ok;
+	}
+
+	int NumaNodeOfCpu(int)
+	{
+		return -1;
+	}
+
+	// Without libnuma the pages land on the node of the thread that first
+	// touches them, so placement follows the pinned transport thread.
+	void* AllocateBuffer(size_t bytes, int)
+	{
+		void* buffer = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return buffer == MAP_FAILED ? 0 : buffer;
+	}
+
+	void FreeBuffer(void* buffer, size_t bytes)
+	{
+		if (buffer != 0)
+			munmap(buffer, bytes);
+	}
+
+#endif
+}
@@ -0,0 +1,52 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          ThreadScheduling.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   CPU affinity, scheduling priority and NUMA placement for
+//				  the acquisition threads of the Etaluma adapter.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _THREADSCHEDULING_H_
+#define _THREADSCHEDULING_H_
+
+#include <cstddef>
+
+namespace ThreadScheduling
+{
+	enum Priority
+	{
+		PRIORITY_NORMAL,
+		PRIORITY_ABOVE_NORMAL,
+		PRIORITY_HIGHEST,
+		PRIORITY_TIME_CRITICAL
+	};
+
+	// Pin the calling thread to cpu (ignored if negative) and set its
+	// priority. Returns false if either request was refused by the OS.
+	bool ConfigureCurrentThread(int cpu, Priority priority);
+
+	// NUMA node that cpu belongs to, or -1 if unknown.
+	int NumaNodeOfCpu(int cpu);
+
+	// Page-aligned allocation, placed on node when it is not negative and
+	// the platform supports it. Release with FreeBuffer.
+	void* AllocateBuffer(size_t bytes, int node);
+	void FreeBuffer(void* buffer, size_t bytes);
+}
+
+#endif //_THREADSCHEDULING_H_
@@ -0,0 +1,194 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TraceLog.cpp
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-frame trace of the Etaluma acquisition pipeline.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#include "TraceLog.h"
+#include "DeviceUtils.h"
+
+using namespace std;
+
+// Shown as thread names by the trace viewers, indexed by TraceLog::Thread.
+const char* const g_TraceThreadNames[] = { "transport", "acquisition" };
+
+// How long the writer sleeps when the rings are empty.
+const int g_TraceFlushMs = 20;
+
+TraceLog::TraceLog() :
+	file_(0),
+	writer_(this),
+	fileEpoch_(0),
+	epoch_(0),
+	closing_(false),
+	written_(0),
+	lost_(0)
+{
+	for (int t = 0; t < THREAD_COUNT; t++) {
+		rings_[t].Allocate(EVENTS_PER_THREAD);
+		open_[t].depth = 0;
+	}
+}
+
+TraceLog::~TraceLog()
+{
+	Close();
+}
+
+bool TraceLog::Open(const string& path)
+{
+	Close();
+
+	file_ = fopen(path.c_str(), "w");
+	if (file_ == 0)
+		return false;
+
+	fprintf(file_, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(file_, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"Etaluma\"}}");
+	for (int t = 0; t < THREAD_COUNT; t++) {
+		fprintf(file_, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			t + 1, g_TraceThreadNames[t]);
+	}
+
+	// Ends of scopes that were open at the last Close may still be in the
+	// rings; they belong to the old epoch and are dropped.
+	Drain(false);
+
+	// Never 0, which means closed.
+	if (++fileEpoch_ == 0)
+		fileEpoch_ = 1;
+	for (int t = 0; t < THREAD_COUNT; t++)
+		open_[t].depth = 0;
+
+	closing_.store(false);
+	written_.store(0);
+	lost_.store(0);
+	epoch_.store(fileEpoch_, memory_order_release);
+	writer_.activate();
+	return true;
+}
+
+void TraceLog::Close()
+{
+	if (file_ == 0)
+		return;
+
+	epoch_.store(0, memory_order_release);
+	closing_.store(true, memory_order_release);
+	writer_.wait();
+
+	Drain(true);
+
+	// Scopes still running end here, so no begin is left unmatched.
+	double nowUs = FrameQueue::Now();
+	for (int t = 0; t < THREAD_COUNT; t++) {
+		while (open_[t].depth > 0) {
+			Event event = open_[t].events[open_[t].depth - 1];
+			event.phase = 'E';
+			event.timestampUs = nowUs;
+			Write(t, event);
+		}
+	}
+
+	fprintf(file_, "\n]}\n");
+	fclose(file_);
+	file_ = 0;
+}
+
+// A full ring means the writer fell behind; the event is dropped rather
+// than making the pipeline wait.
+void TraceLog::Record(Thread thread, const char* name, char phase, unsigned long long frameNumber, unsigned epoch)
+{
+	Event event;
+	event.name = name;
+	event.phase = phase;
+	event.epoch = epoch;
+	event.timestampUs = FrameQueue::Now();
+	event.frameNumber = frameNumber;
+	if (!rings_[thread].TryPush(event))
+		lost_.fetch_add(1, memory_order_relaxed);
+}
+
+int TraceLog::WriteLoop()
+{
+	while (!closing_.load(memory_order_acquire)) {
+		if (Drain(true) == 0)
+			CDeviceUtils::SleepMs(g_TraceFlushMs);
+	}
+
+	return 0;
+}
+
+// Take everything queued so far off the rings, writing the events of the
+// current file if write is set. Returns the number of events taken.
+size_t TraceLog::Drain(bool write)
+{
+	size_t taken = 0;
+	for (int t = 0; t < THREAD_COUNT; t++) {
+		OpenScopes& open = open_[t];
+		Event event;
+		while (rings_[t].TryPop(event)) {
+			taken++;
+			if (!write || event.epoch != fileEpoch_)
+				continue;
+
+			if (event.phase == 'B') {
+				// Too deep to be matched later, so not written at all.
+				if (open.depth == MAX_DEPTH)
+					continue;
+			}
+			else if (event.phase == 'E') {
+				// The begin may have been lost to a full ring, or its end
+				// may have been lost for a scope further in. Close the
+				// inner scopes, or drop the end if there is no begin.
+				int match = open.depth - 1;
+				while (match >= 0 && (open.events[match].name != event.name || open.events[match].frameNumber != event.frameNumber))
+					match--;
+				if (match < 0)
+					continue;
+				while (open.depth > match + 1) {
+					Event inner = open.events[open.depth - 1];
+					inner.phase = 'E';
+					inner.timestampUs = event.timestampUs;
+					Write(t, inner);
+				}
+			}
+
+			Write(t, event);
+		}
+	}
+
+	return taken;
+}
+
+// Write one event, keeping track of the scopes it opens and closes.
+void TraceLog::Write(int thread, const Event& event)
+{
+	OpenScopes& open = open_[thread];
+	if (event.phase == 'B')
+		open.events[open.depth++] = event;
+	else if (event.phase == 'E')
+		open.depth--;
+
+	// Instant events are scoped to their thread.
+	fprintf(file_, ",\n{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%.0f,\"pid\":1,\"tid\":%d,\"args\":{\"frame\":%llu}}",
+		event.name, event.phase, event.phase == 'i' ? "\"s\":\"t\"," : "",
+		event.timestampUs, thread + 1, event.frameNumber);
+	written_.fetch_add(1, memory_order_relaxed);
+}
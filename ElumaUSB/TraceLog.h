@@ -0,0 +1,163 @@
+///////////////////////////////////////////////////////////////////////////////
+// FILE:          TraceLog.h
+// PROJECT:       Micro-Manager
+// SUBSYSTEM:     DeviceAdapters
+//-----------------------------------------------------------------------------
+// DESCRIPTION:   Per-frame trace of the Etaluma acquisition pipeline. The
+//				  pipeline threads append begin and end events to their own
+//				  preallocated rings, and a writer thread turns them into a
+//				  Chrome trace event file, which chrome://tracing and
+//				  ui.perfetto.dev open directly.
+//
+// AUTHOR:        Nicholas Schaub, nicholas.schaub@nist.gov
+//				  http://www.nist.gov/mml/bbd/biomaterials/nicholas-schaub.cfm
+//
+// LICENSE:       This file is distributed under the BSD license.
+//                License text is included with the source distribution.
+//
+//                This file is distributed in the hope that it will be useful,
+//                but WITHOUT ANY WARRANTY; without even the implied warranty
+//                of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+//
+//                IN NO EVENT SHALL THE COPYRIGHT OWNER OR
+//                CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+//                INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES.
+//
+
+#ifndef _TRACELOG_H_
+#define _TRACELOG_H_
+
+#include "DeviceThreads.h"
+#include "FrameQueue.h"
+#include <cstdio>
+#include <string>
+#include <atomic>
+
+// May be opened and closed while a sequence runs. While closed, recording
+// an event costs one atomic load.
+class TraceLog
+{
+public:
+	// Pipeline threads, each the only producer of its own ring.
+	enum Thread
+	{
+		THREAD_TRANSPORT,
+		THREAD_ACQUISITION,
+		THREAD_COUNT
+	};
+
+	// Events a ring holds before the writer must have caught up.
+	static const size_t EVENTS_PER_THREAD = 16384;
+
+	// Scopes a thread may have open at once.
+	static const int MAX_DEPTH = 8;
+
+	TraceLog();
+	~TraceLog();
+
+	bool Open(const std::string& path);
+
+	// Write out the remaining events and terminate the file.
+	void Close();
+
+	bool IsOpen() const { return epoch_.load(std::memory_order_relaxed) != 0; }
+
+	// name must be a string literal, only the pointer is kept. Returns the
+	// epoch to pass to End, 0 if nothing was recorded.
+	unsigned Begin(Thread thread, const char* name, unsigned long long frameNumber)
+	{
+		unsigned epoch = epoch_.load(std::memory_order_acquire);
+		if (epoch != 0)
+			Record(thread, name, 'B', frameNumber, epoch);
+		return epoch;
+	}
+
+	// Recorded even if the trace was closed or reopened since Begin; the
+	// writer drops it unless it belongs to the file it is writing.
+	void End(Thread thread, const char* name, unsigned long long frameNumber, unsigned epoch)
+	{
+		if (epoch != 0)
+			Record(thread, name, 'E', frameNumber, epoch);
+	}
+
+	void Instant(Thread thread, const char* name, unsigned long long frameNumber)
+	{
+		unsigned epoch = epoch_.load(std::memory_order_acquire);
+		if (epoch != 0)
+			Record(thread, name, 'i', frameNumber, epoch);
+	}
+
+	unsigned long long EventsWritten() const { return written_.load(std::memory_order_relaxed); }
+	unsigned long long EventsLost() const { return lost_.load(std::memory_order_relaxed); }
+
+private:
+	struct Event
+	{
+		const char* name;
+		char phase;
+		unsigned epoch;
+		double timestampUs;
+		unsigned long long frameNumber;
+	};
+
+	// Begin events written without their end yet, innermost last.
+	struct OpenScopes
+	{
+		Event events[MAX_DEPTH];
+		int depth;
+	};
+
+	class WriterThread : public MMDeviceThreadBase
+	{
+	public:
+		WriterThread(TraceLog* log) : log_(log) {}
+		int svc(void) throw() { return log_->WriteLoop(); }
+	private:
+		TraceLog* log_;
+	};
+
+	void Record(Thread thread, const char* name, char phase, unsigned long long frameNumber, unsigned epoch);
+	int WriteLoop();
+	size_t Drain(bool write);
+	void Write(int thread, const Event& event);
+
+	FILE* file_;
+	SpscRing<Event> rings_[THREAD_COUNT];
+	OpenScopes open_[THREAD_COUNT];
+	WriterThread writer_;
+	unsigned fileEpoch_;		// epoch of the file being written
+	std::atomic<unsigned> epoch_;	// fileEpoch_ while open, 0 while closed
+	std::atomic<bool> closing_;
+	std::atomic<unsigned long long> written_;
+	std::atomic<unsigned long long> lost_;
+};
+
+// Begin and end event around a scope. The end goes to the same file as the
+// begin, or nowhere if the begin was not recorded, so turning the trace on,
+// off or over to another file halfway leaves no unmatched events.
+class TraceScope
+{
+public:
+	TraceScope(TraceLog& log, TraceLog::Thread thread, const char* name, unsigned long long frameNumber) :
+		log_(log), thread_(thread), name_(name), frameNumber_(frameNumber),
+		epoch_(log.Begin(thread, name, frameNumber))
+	{
+	}
+
+	~TraceScope()
+	{
+		log_.End(thread_, name_, frameNumber_, epoch_);
+	}
+
+private:
+	TraceScope(const TraceScope&);
+	TraceScope& operator=(const TraceScope&);
+
+	TraceLog& log_;
+	TraceLog::Thread thread_;
+	const char* name_;
+	unsigned long long frameNumber_;
+	unsigned epoch_;
+};
+
+#endif //_TRACELOG_H_